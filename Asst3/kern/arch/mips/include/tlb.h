@@ -44,6 +44,10 @@
  *   tlb_read: read a TLB entry out of the TLB into ENTRYHI and ENTRYLO.
  *        INDEX specifies which one to get.
  *
+ *   tlb_setasid: make ASID the address space ID user accesses are
+ *        matched against. Note that tlb_random, tlb_write and
+ *        tlb_probe also set it, from the TLBHI_PID field of ENTRYHI.
+ *
  *   tlb_probe: look for an entry matching the virtual page in ENTRYHI.
  *        Returns the index, or a negative number if no matching entry
  *        was found. ENTRYLO is not actually used, but must be set; 0
@@ -56,6 +60,7 @@
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
@@ -63,10 +68,10 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, kept in
+ * TLBHI_PID. The VM tags user entries with it so that they survive
+ * context switches (see vm.c). TLBLO_GLOBAL is left always zero, as
+ * are the bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +83,9 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+#define NUM_ASID      64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -125,25 +125,53 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown drops the entries for the pages [ts_start, ts_end) of
+ * the address space with hardware ID ts_asid, then counts up
+ * *ts_done so the sender knows when every target is finished. Up to
+ * TLBSHOOTDOWN_PAGES pages are probed one by one; bigger ranges are
+ * found by reading through the whole TLB instead.
+ *
+ * A CPU waits for its shootdown before sending another, so the queue
+ * needs room for one from every other CPU.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_asid;
+	vaddr_t ts_start;
+	vaddr_t ts_end;
+	volatile unsigned *ts_done;
 };
 
-#define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_MAX 32	/* MAXCPUS */
+#define TLBSHOOTDOWN_PAGES 16
 
 /*
  * Helper Functions in vm
  */
+struct addrspace;
 void load_tlb(uint32_t entryhi, uint32_t entrylo);
+void update_tlb(uint32_t entryhi, uint32_t entrylo);
+void vm_tlbflush(void);
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlbshoot(struct addrspace *as, vaddr_t start, vaddr_t end);
+void vm_asid_activate(struct addrspace *as);
+void vm_asid_release(struct addrspace *as);
 uint32_t get_first_10_bits(vaddr_t addr);
 uint32_t get_middle_10_bits(vaddr_t addr);
 
 #define EMPTY 0
 
+/*
+ * Page table entries hold the TLBLO value for a resident page. A page
+ * that has been paged out keeps its swap slot in the frame bits
+ * instead, marked by a software bit the hardware never sees (the
+ * entry is never loaded into the TLB without TLBLO_VALID).
+ *
+ * A resident entry with TLBLO_VALID cleared is a page the clock has
+ * passed over: the next access faults and sets its reference bit.
+ */
+#define PTE_SWAPPED 0x00000001
+#define PTE_TO_SLOT(pte) ((pte) >> 12)
+#define SLOT_TO_PTE(slot) (((slot) << 12) | PTE_SWAPPED)
+
 #endif /* _MIPS_VM_H_ */
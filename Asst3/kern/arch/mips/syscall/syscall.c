@@ -142,6 +142,36 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The 64-bit offset is aligned past a3, so
+			 * like lseek's whence it is on the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS___vmstat:
+		err = sys___vmstat((userptr_t)tf->tf_a0);
+		break;
+
 
 	    /* file calls */
 
@@ -32,12 +32,16 @@
 #include <lib.h>
 #include <spl.h>
 #include <cpu.h>
+#include <platform/maxcpus.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kern/vmstat.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -67,6 +71,12 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 #endif
 
 
+/*
+ * The UTLB refill handler walks these; dumbvm has no page tables, so
+ * they stay NULL and every miss comes to vm_fault.
+ */
+paddr_t **cpu_pagetable[MAXCPUS];
+
 void
 vm_bootstrap(void)
 {
@@ -272,6 +282,8 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_segs[0].ds_vnode = NULL;
+	as->as_segs[1].ds_vnode = NULL;
 
 	return as;
 }
@@ -348,6 +360,31 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return ENOSYS;
 }
 
+/*
+ * dumbvm has no demand paging: remember where the segment's file data
+ * is, and read it all in once the memory exists (as_complete_load).
+ */
+int
+as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		      struct vnode *v, off_t offset, size_t filesize,
+		      int readable, int writeable, int executable)
+{
+	unsigned i;
+	int result;
+
+	result = as_define_region(as, vaddr, sz,
+				  readable, writeable, executable);
+	if (result) {
+		return result;
+	}
+	i = (as->as_vbase2 == 0) ? 0 : 1;
+	as->as_segs[i].ds_vaddr = vaddr;
+	as->as_segs[i].ds_vnode = v;
+	as->as_segs[i].ds_offset = offset;
+	as->as_segs[i].ds_filesize = filesize;
+	return 0;
+}
+
 static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
@@ -387,7 +424,34 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t vbase;
+	paddr_t pbase;
+	unsigned i;
+	int result;
+
+	for (i=0; i<2; i++) {
+		if (as->as_segs[i].ds_vnode == NULL) {
+			continue;
+		}
+		vbase = (i == 0) ? as->as_vbase1 : as->as_vbase2;
+		pbase = (i == 0) ? as->as_pbase1 : as->as_pbase2;
+		uio_kinit(&iov, &ku,
+			  (void *)(PADDR_TO_KVADDR(pbase) +
+				   as->as_segs[i].ds_vaddr - vbase),
+			  as->as_segs[i].ds_filesize,
+			  as->as_segs[i].ds_offset, UIO_READ);
+		result = VOP_READ(as->as_segs[i].ds_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("ELF: short read on segment - file truncated?\n");
+			return ENOEXEC;
+		}
+		as->as_segs[i].ds_vnode = NULL;
+	}
 	return 0;
 }
 
@@ -440,3 +504,59 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+/*
+ * No heap, file mappings or statistics under dumbvm.
+ */
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, size_t length, int writeable, struct vnode *v,
+	off_t offset, size_t filesize, vaddr_t *ret)
+{
+	(void)as;
+	(void)length;
+	(void)writeable;
+	(void)v;
+	(void)offset;
+	(void)filesize;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+	(void)as;
+	(void)vaddr;
+	return ENOSYS;
+}
+
+int
+as_sync(struct addrspace *as, struct vnode *v)
+{
+	/* nothing can be mapped */
+	(void)as;
+	(void)v;
+	return 0;
+}
+
+void
+vm_getstats(struct vmstat *vs)
+{
+	bzero(vs, sizeof(*vs));
+}
+
+void
+vm_printstats(void)
+{
+	kprintf("dumbvm: no VM statistics\n");
+}
@@ -32,6 +32,9 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -40,20 +43,52 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * Fields are whole bytes/words rather than bitfields: frames moving
+ * through the per-CPU caches are updated without frame_table_spinlock,
+ * and must not clobber a neighbouring field written under it.
+ */
 typedef struct ft_entry {
-        unsigned allocated:1; /* the corresponding frame is allocated */
-        unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        uint8_t allocated; /* the corresponding frame is allocated */
+        uint8_t free_block; /* the frame heads a block on a free list */
+        uint8_t referenced; /* user page accessed since the clock hand passed */
+        uint8_t order; /* log2 of the size of the block this frame heads */
+        uint8_t kmtag; /* kmalloc size class + 1 of a heap page, else 0 */
+        uint32_t refcount; /* number of mappings sharing the frame (COW) */
+        struct addrspace *owner; /* user page mapped here, for page-out */
+        vaddr_t vaddr;
+        struct vnode *tc_vnode; /* text cache key, NULL if not cached */
+        uint32_t tc_offset;
+        uint32_t next; /* free list links (frame numbers), while free; */
+        uint32_t prev; /* next is the text cache chain while cached */
 } ft_entry_t;
 
 
 static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
+static uint32_t clock_hand; /* next frame the page-out clock looks at */
 
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Buddy allocator. Free blocks of 2^order frames, aligned to their
+ * size, sit on free_list[order]. Single pages come straight off
+ * free_list[0]; larger requests are rounded up to a power of two and
+ * split from the smallest block that fits. Freed blocks merge with
+ * their buddy. Frame 0 holds the exception vectors and is never free,
+ * so it doubles as the list terminator.
+ */
+#define MAX_ORDER 17            /* 512MB of 4k pages, see ram_bootstrap */
+#define NO_FRAME 0
+
+static uint32_t free_list[MAX_ORDER + 1];
+static unsigned free_list_frames; /* frames on all the free lists */
+
+static void free_list_insert(uint32_t i, unsigned order);
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
@@ -61,6 +96,75 @@ static uint32_t last_frame;
 
 static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Per-CPU caches of free single frames, so that most alloc_kpages(1)
+ * and free_kpages calls never touch frame_table_spinlock. A CPU that
+ * runs dry takes FRAME_CACHE_BATCH frames from the buddy lists in one
+ * go; a full cache gives a batch back. Frames in a cache are neither
+ * allocated nor on a free list. Each cache has its own spinlock, which
+ * is uncontended except when another CPU drains it because the buddy
+ * lists ran out.
+ *
+ * Lock ordering: fc_lock before frame_table_spinlock.
+ */
+#define FRAME_CACHE_SIZE 32
+#define FRAME_CACHE_BATCH 16
+
+struct frame_cache {
+        struct spinlock fc_lock;
+        unsigned fc_count;
+        uint32_t fc_frames[FRAME_CACHE_SIZE];
+        unsigned fc_hits;       /* allocations served from the cache */
+        unsigned fc_misses;     /* allocations that went to the buddy lists */
+};
+
+static struct frame_cache frame_caches[MAXCPUS];
+
+/*
+ * Frames zeroed while a CPU had nothing better to do, for pages that
+ * must start out zeroed (see alloc_zeroed_frame). They are ordinary
+ * allocated frames, handed back to the buddy lists if an allocation
+ * would otherwise fail.
+ */
+#define ZERO_POOL_SIZE 32
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static unsigned zero_pool_count;
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+
+/*
+ * Text cache. A read-only page of an executable that every process
+ * running it sees the same way (see region_text_offset) is entered
+ * here under its vnode and file offset, so that later faults on the
+ * same page map the frame already in memory instead of reading it
+ * again. The cache holds no reference of its own: free_frames drops
+ * the entry when the last mapping goes away. Chains run through the
+ * frames' next fields, all under frame_table_spinlock.
+ */
+#define TEXT_HASH_SIZE 256
+
+static uint32_t text_hash[TEXT_HASH_SIZE];
+
+static unsigned text_bucket(struct vnode *v, uint32_t offset)
+{
+        return (((uintptr_t) v >> 4) ^ (offset >> PAGE_BITS)) % TEXT_HASH_SIZE;
+}
+
+/* Take frame I out of the text cache. Called with frame_table_spinlock. */
+static void text_remove(uint32_t i)
+{
+        uint32_t *link;
+
+        link = &text_hash[text_bucket(frame_table[i].tc_vnode,
+                                      frame_table[i].tc_offset)];
+        while (*link != i) {
+                KASSERT(*link != NO_FRAME);
+                link = &frame_table[*link].next;
+        }
+        *link = frame_table[i].next;
+        frame_table[i].tc_vnode = NULL;
+}
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -129,7 +233,12 @@ ram_bootstrap(void)
         for (i = 0; i < (firstpaddr >> PAGE_BITS); i++) {
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
-                frame_table[i].not_last = FALSE;
+                frame_table[i].free_block = FALSE;
+                frame_table[i].order = 0;
+                frame_table[i].refcount = 1;
+                frame_table[i].owner = NULL;
+                frame_table[i].tc_vnode = NULL;
+                frame_table[i].kmtag = 0;
         }                                            
         
         /* 
@@ -140,6 +249,37 @@ ram_bootstrap(void)
         
         for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].free_block = FALSE;
+                frame_table[i].owner = NULL;
+                frame_table[i].tc_vnode = NULL;
+                frame_table[i].kmtag = 0;
+        }
+        clock_hand = first_frame;
+
+        for (i = 0; i < TEXT_HASH_SIZE; i++) {
+                text_hash[i] = NO_FRAME;
+        }
+
+        for (i = 0; i < MAXCPUS; i++) {
+                spinlock_init(&frame_caches[i].fc_lock);
+                frame_caches[i].fc_count = 0;
+                frame_caches[i].fc_hits = 0;
+                frame_caches[i].fc_misses = 0;
+        }
+
+        /* Carve the free range into the largest aligned blocks */
+        for (i = 0; i <= MAX_ORDER; i++) {
+                free_list[i] = NO_FRAME;
+        }
+        i = first_frame;
+        while (i < last_frame) {
+                unsigned order = MAX_ORDER;
+                while ((i & ((1 << order) - 1)) != 0 ||
+                       i + (1 << order) > last_frame) {
+                        order--;
+                }
+                free_list_insert(i, order);
+                i += 1 << order;
         }
 
         
@@ -188,88 +328,260 @@ ram_getfirstfree(void)
 	return ret;
 }
 
+static void free_list_insert(uint32_t i, unsigned order)
+{
+        frame_table[i].free_block = TRUE;
+        frame_table[i].order = order;
+        free_list_frames += 1 << order;
+        frame_table[i].prev = NO_FRAME;
+        frame_table[i].next = free_list[order];
+        if (free_list[order] != NO_FRAME) {
+                frame_table[free_list[order]].prev = i;
+        }
+        free_list[order] = i;
+}
+
+static void free_list_remove(uint32_t i)
+{
+        unsigned order = frame_table[i].order;
+
+        KASSERT(frame_table[i].free_block == TRUE);
+        if (frame_table[i].prev != NO_FRAME) {
+                frame_table[frame_table[i].prev].next = frame_table[i].next;
+        } else {
+                free_list[order] = frame_table[i].next;
+        }
+        if (frame_table[i].next != NO_FRAME) {
+                frame_table[frame_table[i].next].prev = frame_table[i].prev;
+        }
+        frame_table[i].free_block = FALSE;
+        free_list_frames -= 1 << order;
+}
+
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Take a block of 2^order frames off the free lists, splitting a
+ * larger one if need be. Called with frame_table_spinlock held.
+ * The cost depends only on MAX_ORDER, not on how full memory is.
  */
+static paddr_t alloc_block(unsigned order)
+{
+        unsigned k;
+        uint32_t i, j;
+
+        for (k = order; k <= MAX_ORDER; k++) {
+                if (free_list[k] != NO_FRAME) {
+                        break;
+                }
+        }
+        if (k > MAX_ORDER) {
+                /* Did not find a large enough free block :-( */
+                return (paddr_t) 0;
+        }
 
+        i = free_list[k];
+        free_list_remove(i);
 
-static paddr_t alloc_one_frame(unsigned int npages)
+        /* give back the upper halves we do not need */
+        while (k > order) {
+                k--;
+                free_list_insert(i + (1 << k), k);
+        }
+
+        for (j = i; j < i + (1 << order); j++) {
+                frame_table[j].allocated = TRUE;
+                frame_table[j].order = 0;
+                frame_table[j].refcount = 1;
+                frame_table[j].owner = NULL;
+                frame_table[j].tc_vnode = NULL;
+        }
+        frame_table[i].order = order;
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/*
+ * Put the block of 2^order frames at I back on the free lists,
+ * merging with its buddy for as long as that is free too. Called
+ * with frame_table_spinlock held.
+ */
+static void free_block(uint32_t i, unsigned order)
 {
-        unsigned int i;
+        uint32_t j, buddy;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        for (j = i; j < i + (1 << order); j++) { /* mark block free */
+                frame_table[j].allocated = FALSE;
+                frame_table[j].owner = NULL;
+        }
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+        while (order < MAX_ORDER) {
+                buddy = i ^ (1 << order);
+                if (buddy < first_frame || buddy + (1 << order) > last_frame ||
+                    frame_table[buddy].free_block == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+                free_list_remove(buddy);
+                if (buddy < i) {
+                        i = buddy;
+                }
+                order++;
+        }
+        free_list_insert(i, order);
+}
 
-                        spinlock_release(&frame_table_spinlock);
+/*
+ * Give every cached frame back to the buddy lists, so that a failed
+ * allocation can see all of free memory.
+ */
+static void frame_cache_drain(void)
+{
+        struct frame_cache *fc;
+        unsigned n;
 
-                        return (paddr_t) (i << PAGE_BITS);
+        for (n = 0; n < MAXCPUS; n++) {
+                fc = &frame_caches[n];
+                spinlock_acquire(&fc->fc_lock);
+                spinlock_acquire(&frame_table_spinlock);
+                while (fc->fc_count > 0) {
+                        free_block(fc->fc_frames[--fc->fc_count], 0);
                 }
+                spinlock_release(&frame_table_spinlock);
+                spinlock_release(&fc->fc_lock);
         }
-        
-        /* Did not find an unallocated frame :-( */
+}
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+static paddr_t frame_cache_alloc(void)
+{
+        struct frame_cache *fc;
+        paddr_t paddr;
+        uint32_t i;
+
+        if (!CURCPU_EXISTS()) {
+                /* too early in boot for per-CPU state */
+                return (paddr_t) 0;
+        }
+
+        fc = &frame_caches[curcpu->c_number];
+        spinlock_acquire(&fc->fc_lock);
+        if (fc->fc_count == 0) {
+                fc->fc_misses++;
+                spinlock_acquire(&frame_table_spinlock);
+                while (fc->fc_count < FRAME_CACHE_BATCH) {
+                        paddr = alloc_block(0);
+                        if (paddr == 0) {
+                                break;
+                        }
+                        i = paddr >> PAGE_BITS;
+                        frame_table[i].allocated = FALSE;
+                        fc->fc_frames[fc->fc_count++] = i;
+                }
+                spinlock_release(&frame_table_spinlock);
+                if (fc->fc_count == 0) {
+                        spinlock_release(&fc->fc_lock);
+                        return (paddr_t) 0;
+                }
+        } else {
+                fc->fc_hits++;
+        }
+
+        i = fc->fc_frames[--fc->fc_count];
+        frame_table[i].allocated = TRUE;
+        frame_table[i].order = 0;
+        frame_table[i].refcount = 1;
+        frame_table[i].owner = NULL;
+        frame_table[i].tc_vnode = NULL;
+        spinlock_release(&fc->fc_lock);
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+/*
+ * Cache the unshared single frame I on this CPU. Returns false if
+ * there is no per-CPU state yet.
+ */
+static bool frame_cache_free(uint32_t i)
 {
-        unsigned int i,j;
+        struct frame_cache *fc;
 
+        if (!CURCPU_EXISTS()) {
+                return false;
+        }
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        fc = &frame_caches[curcpu->c_number];
+        spinlock_acquire(&fc->fc_lock);
+        frame_table[i].allocated = FALSE;
+        frame_table[i].owner = NULL;
+        if (fc->fc_count == FRAME_CACHE_SIZE) {
+                /* full: hand a batch back to the global pool */
+                spinlock_acquire(&frame_table_spinlock);
+                while (fc->fc_count > FRAME_CACHE_SIZE - FRAME_CACHE_BATCH) {
+                        free_block(fc->fc_frames[--fc->fc_count], 0);
+                }
+                spinlock_release(&frame_table_spinlock);
+        }
+        fc->fc_frames[fc->fc_count++] = i;
+        spinlock_release(&fc->fc_lock);
+
+        return true;
+}
 
+/*
+ * Give the pre-zeroed frames back, so that a failed allocation can
+ * use them.
+ */
+static void zero_pool_drain(void)
+{
+        uint32_t i;
+
+        spinlock_acquire(&zero_pool_lock);
         spinlock_acquire(&frame_table_spinlock);
+        while (zero_pool_count > 0) {
+                i = zero_pool[--zero_pool_count];
+                free_block(i, 0);
+        }
+        spinlock_release(&frame_table_spinlock);
+        spinlock_release(&zero_pool_lock);
+}
 
-        i = first_frame; j = 0;
+static paddr_t alloc_frames(unsigned int npages)
+{
+        unsigned order;
+        paddr_t paddr;
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
-                }
-                else {
-                        j = j + 1; /* increment count of free frames */
+        for (order = 0; (1U << order) < npages; order++) {
+                if (order == MAX_ORDER) {
+                        return (paddr_t) 0;
                 }
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
+        if (order == 0) {
+                paddr = frame_cache_alloc();
+                if (paddr != 0) {
+                        return paddr;
                 }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+        paddr = alloc_block(order);
+        spinlock_release(&frame_table_spinlock);
 
+        if (paddr == 0) {
+                /* free frames may be sitting in the caches or the pool */
+                zero_pool_drain();
+                frame_cache_drain();
+                spinlock_acquire(&frame_table_spinlock);
+                paddr = alloc_block(order);
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+        return paddr;
 }
 
-static void free_frames(vaddr_t vaddr)
+/*
+ * Drop one reference to the block at VADDR. AS is the address space
+ * letting go of a user frame, or NULL for anyone else (see frame_free).
+ */
+static void free_frames(vaddr_t vaddr, struct addrspace *as)
 {
         paddr_t paddr;
         uint32_t i;
@@ -280,18 +592,43 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
-        spinlock_acquire(&frame_table_spinlock);
-
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+
+        /*
+         * An unshared single frame can only be referenced by us, so
+         * it goes to this CPU's cache without the global lock. Not
+         * so a text cache frame, which frame_text_lookup may be
+         * sharing right now.
+         */
+        if (frame_table[i].order == 0 && frame_table[i].refcount == 1 &&
+            frame_table[i].tc_vnode == NULL && frame_cache_free(i)) {
+                return;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /*
+         * A frame shared copy-on-write is only released when the
+         * last mapping lets go of it. If the owner let go, we cannot
+         * tell which mapping is left; stop paging it until a sharer
+         * faults on it again (frame_claim).
+         */
+        if (frame_table[i].refcount > 1) {
+                frame_table[i].refcount--;
+                if (frame_table[i].owner == as) {
+                        frame_table[i].owner = NULL;
                 }
+                spinlock_release(&frame_table_spinlock);
+                return;
         }
+
+        if (frame_table[i].tc_vnode != NULL) {
+                text_remove(i);
+        }
+        free_block(i, frame_table[i].order);
+
         spinlock_release(&frame_table_spinlock);
 }
         
@@ -300,12 +637,8 @@ vaddr_t
 alloc_kpages(unsigned npages)
 {
         paddr_t paddr;
-        if (npages > 1 ) {
-                paddr = alloc_multiple_frames(npages);
-        }
-        else {
-                paddr = alloc_one_frame(npages);
-        }
+
+        paddr = alloc_frames(npages);
         
 	if (paddr == 0) {
 		return 0;
@@ -316,6 +649,400 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-        free_frames(addr);
+        free_frames(addr, NULL);
+}
+
+/*
+ * Release AS's mapping of the user frame PADDR. Unlike free_kpages,
+ * this also takes the owner off a frame that stays shared when AS was
+ * the owner; free_kpages leaves the owner alone, since whoever drops
+ * a reference that way (a fault that lost a race, say) never mapped
+ * the frame.
+ */
+void
+frame_free(paddr_t paddr, struct addrspace *as)
+{
+        free_frames(PADDR_TO_KVADDR(paddr), as);
 }
 
+/*
+ * Release a batch of user frames mapped by AS, as free_kpages would,
+ * but taking the frame table lock once for all of them. Used when a
+ * whole address space or range goes away; the frames skip the per-CPU
+ * cache, which would only overflow back into the buddy lists anyway.
+ *
+ * A frame still shared copy-on-write keeps its owner unless AS is the
+ * owner, since the owner's mapping is then still there to page out.
+ */
+void
+frame_free_batch(const paddr_t *paddrs, unsigned n, struct addrspace *as)
+{
+        unsigned k;
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (k = 0; k < n; k++) {
+                i = paddrs[k] >> PAGE_BITS;
+                if (frame_table[i].allocated == FALSE) {
+                        panic("Double free error!!");
+                }
+                KASSERT(frame_table[i].order == 0);
+                if (frame_table[i].refcount > 1) {
+                        frame_table[i].refcount--;
+                        if (frame_table[i].owner == as) {
+                                frame_table[i].owner = NULL;
+                        }
+                        continue;
+                }
+                if (frame_table[i].tc_vnode != NULL) {
+                        text_remove(i);
+                }
+                free_block(i, 0);
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Copy-on-write support. frame_ref adds a mapping to an allocated
+ * single frame; the matching release is free_kpages. frame_refcount
+ * lets the fault handler decide whether a shared frame must be copied
+ * or can simply be made writeable again.
+ */
+void
+frame_ref(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].order == 0);
+        frame_table[i].refcount++;
+        spinlock_release(&frame_table_spinlock);
+}
+
+unsigned
+frame_refcount(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        unsigned refcount;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        refcount = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+
+        return refcount;
+}
+
+
+/*
+ * Page-out support. A user frame mapped by exactly one page table
+ * records that mapping so swap_evict can find the entry to update.
+ * Frames without an owner (kernel memory, frames still shared
+ * copy-on-write) are never chosen as victims.
+ */
+void
+frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        frame_table[i].owner = as;
+        frame_table[i].vaddr = vaddr & PAGE_FRAME;
+        frame_table[i].referenced = TRUE;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * swap_evict writes a victim out with no locks held, so it checks
+ * afterwards, under swap_lock, that AS still owns the frame. An
+ * address space that let go of it meanwhile is no longer the owner
+ * and may be gone altogether.
+ */
+bool
+frame_owned_by(paddr_t paddr, struct addrspace *as)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        bool owned;
+
+        spinlock_acquire(&frame_table_spinlock);
+        owned = frame_table[i].owner == as;
+        spinlock_release(&frame_table_spinlock);
+
+        return owned;
+}
+
+/*
+ * Whether PADDR is in the text cache. Such a frame is never written
+ * and can be read again from its file, so page-out just drops it.
+ */
+bool
+frame_is_text(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        bool text;
+
+        spinlock_acquire(&frame_table_spinlock);
+        text = frame_table[i].tc_vnode != NULL;
+        spinlock_release(&frame_table_spinlock);
+
+        return text;
+}
+
+/*
+ * Page replacement clock. Hands back the next frame under the clock
+ * hand that could be paged out, along with its reference bit, and
+ * clears the bit as the hand passes. The caller gives referenced
+ * frames a second chance (see swap_evict). Returns 0 if no frame can
+ * be paged out.
+ */
+paddr_t
+frame_clock_next(struct addrspace **as, vaddr_t *vaddr, bool *referenced)
+{
+        uint32_t i, n;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (n = first_frame; n < last_frame; n++) {
+                i = clock_hand;
+                clock_hand = (i + 1 < last_frame) ? i + 1 : first_frame;
+                if (frame_table[i].allocated == TRUE &&
+                    frame_table[i].owner != NULL &&
+                    frame_table[i].refcount == 1) {
+                        *as = frame_table[i].owner;
+                        *vaddr = frame_table[i].vaddr;
+                        *referenced = frame_table[i].referenced;
+                        frame_table[i].referenced = FALSE;
+                        spinlock_release(&frame_table_spinlock);
+                        return (paddr_t) (i << PAGE_BITS);
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+        return (paddr_t) 0;
+}
+
+/*
+ * Reference bits are kept in software: vm_fault sets the bit whenever
+ * it loads a page into the TLB. Returns false if the frame is a user
+ * page nobody owns, which vm_fault may then claim.
+ */
+bool
+frame_set_referenced(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        bool owned;
+
+        spinlock_acquire(&frame_table_spinlock);
+        frame_table[i].referenced = TRUE;
+        owned = frame_table[i].owner != NULL || frame_table[i].refcount > 1;
+        spinlock_release(&frame_table_spinlock);
+
+        return owned;
+}
+
+/*
+ * A frame loses its owner when a sharer lets go of it and we cannot
+ * tell which mapping is left. The next fault on it from an address
+ * space that maps it alone, with that space's pt_lock held, makes
+ * that space the owner again so the frame can be paged out.
+ */
+void
+frame_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        if (frame_table[i].owner == NULL && frame_table[i].refcount == 1) {
+                frame_table[i].owner = as;
+                frame_table[i].vaddr = vaddr & PAGE_FRAME;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * kmalloc tags the pages it carves into small blocks with their size
+ * class, so kfree can tell a block's size without a search. Only the
+ * owner of a page writes its tag, so no lock is needed.
+ */
+void
+frame_set_kmtag(vaddr_t kvaddr, unsigned tag)
+{
+        uint32_t i = KVADDR_TO_PADDR(kvaddr) >> PAGE_BITS;
+
+        KASSERT(i < last_frame);
+        KASSERT(frame_table[i].allocated == TRUE);
+        frame_table[i].kmtag = tag;
+}
+
+unsigned
+frame_kmtag(vaddr_t kvaddr)
+{
+        uint32_t i;
+
+        if (kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1) {
+                return 0;
+        }
+        i = KVADDR_TO_PADDR(kvaddr) >> PAGE_BITS;
+        if (i >= last_frame) {
+                return 0;
+        }
+        return frame_table[i].kmtag;
+}
+
+/* Number of frames the allocator manages (bounds a clock sweep) */
+unsigned
+frame_count(void)
+{
+        return last_frame - first_frame;
+}
+
+/*
+ * Number of free frames: on the buddy lists or in a per-CPU cache.
+ * The pre-zeroed pool is not counted; it is free only in a pinch.
+ */
+unsigned
+frame_free_count(void)
+{
+        unsigned n, count;
+
+        spinlock_acquire(&frame_table_spinlock);
+        count = free_list_frames;
+        spinlock_release(&frame_table_spinlock);
+        for (n = 0; n < MAXCPUS; n++) {
+                /* unlocked peek; this is only for statistics */
+                count += frame_caches[n].fc_count;
+        }
+        return count;
+}
+
+/*
+ * Hit/miss counters of CPU CPUNUM's frame cache.
+ */
+void
+frame_cache_stats(unsigned cpunum, unsigned *hits, unsigned *misses)
+{
+        struct frame_cache *fc;
+
+        KASSERT(cpunum < MAXCPUS);
+        fc = &frame_caches[cpunum];
+        spinlock_acquire(&fc->fc_lock);
+        *hits = fc->fc_hits;
+        *misses = fc->fc_misses;
+        spinlock_release(&fc->fc_lock);
+}
+
+/*
+ * Look up the text page at OFFSET in V. If it is in memory, add a
+ * mapping to its frame (released with free_kpages) and return it;
+ * otherwise return 0.
+ */
+paddr_t
+frame_text_lookup(struct vnode *v, uint32_t offset)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (i = text_hash[text_bucket(v, offset)]; i != NO_FRAME;
+             i = frame_table[i].next) {
+                if (frame_table[i].tc_vnode == v &&
+                    frame_table[i].tc_offset == offset) {
+                        KASSERT(frame_table[i].allocated == TRUE);
+                        frame_table[i].refcount++;
+                        break;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/*
+ * Enter the freshly read frame PADDR as the text page at OFFSET in V,
+ * unless someone else has entered that page meanwhile.
+ */
+void
+frame_text_insert(paddr_t paddr, struct vnode *v, uint32_t offset)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        unsigned b = text_bucket(v, offset);
+        uint32_t j;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].order == 0);
+        KASSERT(frame_table[i].tc_vnode == NULL);
+        for (j = text_hash[b]; j != NO_FRAME; j = frame_table[j].next) {
+                if (frame_table[j].tc_vnode == v &&
+                    frame_table[j].tc_offset == offset) {
+                        spinlock_release(&frame_table_spinlock);
+                        return;
+                }
+        }
+        frame_table[i].tc_vnode = v;
+        frame_table[i].tc_offset = offset;
+        frame_table[i].next = text_hash[b];
+        text_hash[b] = i;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Take a frame from the pre-zeroed pool, or return 0 if it is empty.
+ */
+vaddr_t
+frame_zero_get(void)
+{
+        uint32_t i;
+
+        spinlock_acquire(&zero_pool_lock);
+        if (zero_pool_count == 0) {
+                spinlock_release(&zero_pool_lock);
+                return 0;
+        }
+        i = zero_pool[--zero_pool_count];
+        spinlock_release(&zero_pool_lock);
+        VMSTAT_INC(vs_zeropool);
+
+        return PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS));
+}
+
+/*
+ * Called from the idle loop: zero one more frame for the pool.
+ * Returns false if the pool is full or no frame is free, so the CPU
+ * can go to sleep. This never drains the caches or pages anything
+ * out; the pool only takes memory nobody is asking for.
+ */
+bool
+frame_zero_refill(void)
+{
+        paddr_t paddr;
+
+        if (zero_pool_count >= ZERO_POOL_SIZE) {
+                /* unlocked peek; a stale answer costs at most a pass */
+                return false;
+        }
+
+        paddr = frame_cache_alloc();
+        if (paddr == 0) {
+                spinlock_acquire(&frame_table_spinlock);
+                paddr = alloc_block(0);
+                spinlock_release(&frame_table_spinlock);
+        }
+        if (paddr == 0) {
+                return false;
+        }
+
+        bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+        spinlock_acquire(&zero_pool_lock);
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+                zero_pool[zero_pool_count++] = paddr >> PAGE_BITS;
+                paddr = 0;
+        }
+        spinlock_release(&zero_pool_lock);
+        if (paddr != 0) {
+                /* another CPU filled it meanwhile */
+                free_frames(PADDR_TO_KVADDR(paddr), NULL);
+        }
+        return true;
+}
@@ -850,14 +850,14 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP - files can be mapped, pages go through emufs_read/write
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
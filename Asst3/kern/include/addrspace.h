@@ -35,11 +35,20 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
 #include <synch.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct region;
+
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(region, ADDRSPACEINLINE);
+DEFARRAY(region, ADDRSPACEINLINE);
 
 
 /*
@@ -58,12 +67,35 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
+        struct {                        /* read in by as_complete_load */
+                vaddr_t ds_vaddr;
+                struct vnode *ds_vnode;
+                off_t ds_offset;
+                size_t ds_filesize;
+        } as_segs[2];
 #else
         /* Put stuff here for your VM system */
-        /* only needs region for addrspace */
-        struct region *head;
+        /*
+         * Regions sorted by base_addr (and, for the empty heap, by
+         * end), so they can be binary searched; see region_search.
+         * as_lastregion is the region get_region found last.
+         */
+        struct regionarray as_regions;
+        struct region *as_lastregion;
 	paddr_t **pagetable;
+	/* entries in use in each second-level table, under pt_lock */
+	uint16_t *pt_count;
 	struct lock *pt_lock;
+	/* hardware address space ID, see vm_asid_activate */
+	uint32_t as_asid;
+	uint32_t as_asid_gen;
+	/* CPUs that have run it and may hold its TLB entries */
+	uint32_t as_cpus;
+	/* heap region, NULL until as_complete_load; the break */
+	struct region *as_heap;
+	vaddr_t as_heapend;
+	/* stack region, NULL until as_define_stack */
+	struct region *as_stack;
 
 #endif
 };
@@ -79,19 +111,39 @@ struct region {
 	/* Permissions */
 	int readable;
 	int writeable;
-        int old_writeable;
 	int executable;
-	struct region *next;
+	/*
+	 * Backing file for demand paging. Pages overlapping
+	 * [file_vaddr, file_vaddr + filesize) are read from vnode at
+	 * file_offset on first touch, everything else is zero-filled.
+	 * vnode is NULL for anonymous regions (stack, bss only).
+	 */
+	struct vnode *vnode;
+	off_t file_offset;
+	vaddr_t file_vaddr;
+	size_t filesize;
+	/*
+	 * Set for mmap regions: pages are entered without TLBLO_DIRTY
+	 * so that the first write is noticed, and modified pages are
+	 * written back to the file on munmap, fsync and exit.
+	 */
+	int mapped;
 };
 
 
 struct region * region_create(vaddr_t vaddr, size_t memsize, int readable, int writeable, int executable);
-void region_insert(struct addrspace *as, struct region *new);
+int region_fill(struct region *region, vaddr_t vaddr, vaddr_t kvaddr);
+int region_writeback(struct addrspace *as, struct region *region, vaddr_t scratch);
+bool region_text_offset(struct region *region, vaddr_t vaddr, uint32_t *offset);
+bool region_zero_page(struct region *region, vaddr_t vaddr);
+int region_insert(struct addrspace *as, struct region *new);
+void region_remove(struct addrspace *as, struct region *region);
+unsigned region_search(struct addrspace *as, vaddr_t vaddr);
 void region_copy(struct region *old, struct region *new);
 int region_valid(struct addrspace *as, vaddr_t vaddr, size_t memsize);
 struct region *get_region(struct addrspace *as, vaddr_t vaddr);
 void regions_cleanup(struct addrspace *as);
-int pt_copy(struct addrspace *old_as, paddr_t **old_pt, paddr_t **new_pt);
+int pt_copy(paddr_t **old_pt, paddr_t **new_pt, uint16_t *new_count);
 
 
 
@@ -122,6 +174,9 @@ int pt_copy(struct addrspace *old_as, paddr_t **old_pt, paddr_t **new_pt);
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file_region - as_define_region, but the region is
+ *                backed by a file and filled from it on demand.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -132,6 +187,23 @@ int pt_copy(struct addrspace *old_as, paddr_t **old_pt, paddr_t **new_pt);
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_grow_stack - extend the stack down to cover VADDR, if that
+ *                stays within vm_stack_limit and the guard page.
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes, handing back the
+ *                old break.
+ *
+ *    as_release_pages - free the pages of a page-aligned range.
+ *
+ *    as_mmap   - map FILESIZE bytes of V from OFFSET into a new region
+ *                of LENGTH bytes somewhere below the space kept for
+ *                the stack to grow into.
+ *
+ *    as_munmap - write back and remove the mapping starting at VADDR.
+ *
+ *    as_sync   - write back the modified pages of every mapping of V
+ *                (or of every mapping, if V is NULL).
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -147,9 +219,26 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file_region(struct addrspace *as,
+                                        vaddr_t vaddr, size_t sz,
+                                        struct vnode *v, off_t offset,
+                                        size_t filesize,
+                                        int readable,
+                                        int writeable,
+                                        int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+void              as_release_pages(struct addrspace *as,
+                                   vaddr_t start, vaddr_t end);
+int               as_mmap(struct addrspace *as, size_t length,
+                          int writeable, struct vnode *v, off_t offset,
+                          size_t filesize, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr);
+int               as_sync(struct addrspace *as, struct vnode *v);
 
 
 /*
@@ -167,7 +256,10 @@ int lookup_region(struct addrspace *as, vaddr_t vaddr, int faulttype);
 int insert_pt(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
 paddr_t look_up_pt(struct addrspace *as, vaddr_t vaddr);
 int probe_pt(struct addrspace *as, vaddr_t vaddr);
-int update_pt(struct addrspace *as, vaddr_t addr, paddr_t paddr);
 vaddr_t alloc_frame(struct addrspace *as, vaddr_t vaddr);
+vaddr_t alloc_zeroed_frame(struct addrspace *as, vaddr_t vaddr);
+int cow_fault(struct addrspace *as, vaddr_t vaddr);
+int page_in(struct addrspace *as, struct region *region, vaddr_t vaddr, paddr_t pte);
+void fault_around(struct addrspace *as, struct region *region, vaddr_t vaddr, int faulttype);
 
 #endif /* _ADDRSPACE_H_ */
@@ -61,6 +61,7 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_stealrand;		/* Random state for work stealing */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +69,7 @@ struct cpu {
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	unsigned c_boost_epoch;		/* Last priority boost applied */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -155,6 +157,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus sends it to every CPU in the mask CPUS (bit N
+ * for c_number N) except the current one, and returns how many.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +173,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
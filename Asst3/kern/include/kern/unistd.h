@@ -35,5 +35,9 @@
 #define STDOUT_FILENO 1      /* Standard output */
 #define STDERR_FILENO 2      /* Standard error */
 
+/* Protection flags for mmap */
+#define PROT_READ     1
+#define PROT_WRITE    2
+
 
 #endif /* _KERN_UNISTD_H_ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * VM statistics, as returned by __vmstat() and printed by the "vm"
+ * menu command. The event counts are kept per CPU and summed when
+ * asked for; they run from boot and wrap around.
+ */
+struct vmstat {
+	/* Faults that reached vm_fault; the UTLB refill handles the rest */
+	__u32 vs_faults;
+	__u32 vs_faults_read;
+	__u32 vs_faults_write;
+	__u32 vs_faults_readonly;
+
+	/* How faults were resolved */
+	__u32 vs_tlbreloads;	/* resident page loaded into the TLB */
+	__u32 vs_zerofills;	/* new page zero-filled */
+	__u32 vs_zeromaps;	/* read mapped to the shared zero page */
+	__u32 vs_filereads;	/* new page read from a file */
+	__u32 vs_textshares;	/* text page found in the text cache */
+	__u32 vs_faultaround;	/* neighbouring pages mapped ahead */
+	__u32 vs_cowcopies;	/* shared page copied on write */
+	__u32 vs_cowreuses;	/* last sharer made the page writeable */
+	__u32 vs_swapins;	/* pages read back from swap */
+	__u32 vs_swapouts;	/* pages written out to swap */
+	__u32 vs_textdrops;	/* text pages dropped instead */
+
+	/* Address spaces and the TLB */
+	__u32 vs_ptcopies;	/* page table entries copied by fork */
+	__u32 vs_activates;	/* address space activations */
+	__u32 vs_shootdowns;	/* TLB shootdowns sent to other CPUs */
+
+	/* Frames */
+	__u32 vs_frameallocs;	/* frames allocated for user pages */
+	__u32 vs_zeropool;	/* zeroed frames taken from the idle pool */
+	__u32 vs_cachehits;	/* allocations served by a per-CPU cache */
+	__u32 vs_cachemisses;	/* allocations that took the global lock */
+	__u32 vs_framesfree;	/* frames free right now */
+	__u32 vs_framestotal;	/* frames the allocator manages */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
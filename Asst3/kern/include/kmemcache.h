@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+#include <spinlock.h>
+
+/*
+ * Object caches for kernel structures that are allocated and freed
+ * a lot (regions, locks, open files, ...).
+ *
+ * Each cache hands out objects of one size from slabs: whole pages
+ * from alloc_kpages, cut into as many objects as fit after a small
+ * header. That saves rounding up to a kmalloc size class and the
+ * search subpage_kmalloc does, and kmem_cache_free finds the slab from
+ * the page address.
+ *
+ * If a cache has a constructor it is run once for each object when
+ * its slab is created, and the destructor once when the slab is given
+ * back. A constructor returns 0, or an error if it could not set the
+ * object up, in which case the allocation fails. In between, objects
+ * must be freed back to the cache in their constructed state, so that
+ * the next kmem_cache_alloc can skip that work (e.g. a lock keeps its
+ * wait channel).
+ *
+ * The free list lives in the slab header rather than in the objects,
+ * so freeing does not overwrite constructed state.
+ *
+ * Caches may be defined statically with KMEM_CACHE_INITIALIZER, which
+ * works before anything has been bootstrapped, or made at run time
+ * with kmem_cache_create. Objects must be no bigger than half a page.
+ *
+ * Operations:
+ *
+ * create -  make a cache of SIZE-byte objects called NAME. CTOR and
+ *           DTOR may be NULL.
+ * destroy - give back a cache with nothing allocated from it.
+ * alloc -   get an object, or NULL if out of memory.
+ * free -    return an object to the cache it came from.
+ * printstats - print the counters of every cache that has been used.
+ */
+
+struct kmem_slab;
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, rounded up */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;
+
+	/* slab layout, worked out on first use */
+	unsigned kc_perslab;		/* objects per slab */
+	unsigned kc_offset;		/* of the first object in the slab */
+
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	struct kmem_slab *kc_full;	/* slabs with none */
+	unsigned kc_emptyslabs;		/* partial slabs that are all free */
+	struct kmem_cache *kc_next;	/* list of caches, for printstats */
+
+	/* statistics */
+	unsigned kc_allocs;
+	unsigned kc_frees;
+	unsigned kc_inuse;
+	unsigned kc_slabs;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, SPINLOCK_INITIALIZER, \
+	  0, 0, NULL, NULL, 0, NULL, 0, 0, 0, 0 }
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
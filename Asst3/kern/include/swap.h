@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system.
+ *
+ * Pages are paged out to the raw disk SWAP_DEVICE in PAGE_SIZE
+ * slots. Free slots are tracked in a bitmap. A page table entry for a
+ * page that is out on disk holds its slot number (see PTE_SWAPPED in
+ * machine/vm.h).
+ *
+ * If the swap device is missing, paging is disabled and running out
+ * of frames is reported as ENOMEM as before.
+ */
+
+#define SWAP_DEVICE "lhd0:"
+
+struct addrspace;
+
+/*
+ * Swap operations:
+ *
+ * bootstrap - attach the swap device (called from vm_bootstrap).
+ * in -        read SLOT into the frame PADDR and free the slot.
+ * read -      read SLOT into the kernel page KVADDR, keeping the slot.
+ * free -      release SLOT without reading it.
+ * dup -       copy SLOT into a new slot (for as_copy).
+ * evict -     page out one user frame so that it can be reused.
+ *             Must be called without holding any page table lock.
+ *
+ * swap_lock_acquire/release serialise page-out against address space
+ * teardown: as_destroy takes the lock around releasing its frames so
+ * that swap_evict never sees a dead address space.
+ */
+void swap_bootstrap(void);
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_read(unsigned slot, vaddr_t kvaddr);
+void swap_free(unsigned slot);
+int swap_dup(unsigned slot, unsigned *ret);
+int swap_evict(void);
+
+void swap_lock_acquire(void);
+void swap_lock_release(void);
+
+#endif /* _SWAP_H_ */
@@ -64,6 +64,9 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* Number of scheduler priority levels; see schedule() */
+#define MLFQ_LEVELS 4
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -85,6 +88,14 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields; see schedule(). Protected by the run
+	 * queue lock of t_cpu.
+	 */
+	unsigned t_level;		/* MLFQ priority level, 0 is highest */
+	unsigned t_ticks;		/* Quantum used so far at this level */
+	unsigned t_epoch;		/* Last priority boost applied */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -159,15 +170,10 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread for its time and preempt it if its
+ * quantum is up. Called from the timer interrupt.
  */
 void schedule(void);
 
-/*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
- */
-void thread_consider_migration(void);
-
 
 #endif /* _THREAD_H_ */
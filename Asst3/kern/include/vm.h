@@ -33,16 +33,32 @@
 /*
  * VM system-related definitions.
  */
-#define USER_STACK_SIZE 16 * PAGE_SIZE /* defined in spec */
+/*
+ * The user stack starts out USER_STACK_SIZE long and grows down on
+ * faults up to vm_stack_limit bytes, as long as an unmapped guard page
+ * is left above whatever lies below it.
+ */
+#define USER_STACK_SIZE PAGE_SIZE
+#define USER_STACK_LIMIT (1024 * 1024)
+
+/*
+ * Pages in the aligned window around a fault that vm_fault maps ahead
+ * of time (see fault_around). A power of two; 1 turns it off.
+ */
+#define FAULT_AROUND_PAGES 8
 
 
 
 #include <machine/vm.h>
+#include <kern/vmstat.h>
 /*
  * Added directives
  */
 #include <addrspace.h>
 
+struct addrspace;
+struct vnode;
+
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -56,10 +72,61 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Fault-around window in pages, FAULT_AROUND_PAGES unless changed */
+extern unsigned vm_fault_around;
+
+/* Largest the user stack may grow, USER_STACK_LIMIT unless changed */
+extern size_t vm_stack_limit;
+
+/*
+ * Per-CPU VM event counters. They are bumped without a lock, so an
+ * update is lost now and then when a thread changes CPU halfway;
+ * that is fine for statistics. Callers need <current.h> and <cpu.h>.
+ */
+extern struct vmstat vm_cpustats[];
+#define VMSTAT_INC(field) (vm_cpustats[curcpu->c_number].field++)
+
+/* Sum the counters and fill in the frame counts; print them */
+void vm_getstats(struct vmstat *vs);
+void vm_printstats(void);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Size class tags on kernel heap pages, for kfree */
+void frame_set_kmtag(vaddr_t kvaddr, unsigned tag);
+unsigned frame_kmtag(vaddr_t kvaddr);
+
+/* Share a user frame between address spaces (copy-on-write) */
+void frame_ref(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+/* Release user frames of AS, one or many at once */
+void frame_free(paddr_t paddr, struct addrspace *as);
+void frame_free_batch(const paddr_t *paddrs, unsigned n, struct addrspace *as);
+
+/* Reverse mapping of user frames and the clock, for page-out */
+void frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t frame_clock_next(struct addrspace **as, vaddr_t *vaddr, bool *referenced);
+bool frame_set_referenced(paddr_t paddr);
+void frame_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+bool frame_owned_by(paddr_t paddr, struct addrspace *as);
+bool frame_is_text(paddr_t paddr);
+unsigned frame_count(void);
+
+/* Text pages shared between processes running the same file */
+paddr_t frame_text_lookup(struct vnode *v, uint32_t offset);
+void frame_text_insert(paddr_t paddr, struct vnode *v, uint32_t offset);
+
+/* Pool of frames zeroed ahead of time by idle CPUs */
+vaddr_t frame_zero_get(void);
+bool frame_zero_refill(void);
+
+/* Per-CPU frame cache counters, and how many frames are free */
+void frame_cache_stats(unsigned cpunum, unsigned *hits, unsigned *misses);
+unsigned frame_free_count(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -44,6 +44,7 @@
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
+#include <vm.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -471,6 +472,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -606,6 +619,7 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM statistics                  ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +671,7 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -43,6 +43,7 @@
 #include <current.h>
 #include <synch.h>
 #include <pid.h>
+#include <kmemcache.h>
 
 /*
  * Structure for holding exit data of a thread.
@@ -75,6 +76,32 @@ static int nprocs;			// number of allocated pids
 
 
 
+/*
+ * pidinfo structures come from an object cache and keep their cv.
+ */
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_cv = cv_create("pidinfo cv");
+	return pi->pi_cv == NULL ? ENOMEM : 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+}
+
+static struct kmem_cache pidinfo_cache =
+	KMEM_CACHE_INITIALIZER("pidinfo", sizeof(struct pidinfo),
+			       pidinfo_ctor, pidinfo_dtor);
+
 /*
  * Create a pidinfo structure for the specified pid.
  */
@@ -86,17 +113,11 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(&pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
@@ -114,8 +135,7 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	kmem_cache_free(&pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -32,18 +32,14 @@
  * Code to load an ELF-format executable into the current address space.
  *
  * It makes the following address space calls:
- *    - first, as_define_region once for each segment of the program;
+ *    - first, as_define_file_region once for each segment of the
+ *      program, which maps the segment from the executable;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
- * This gives the VM code enough flexibility to deal with even grossly
- * mis-linked executables if that proves desirable. Under normal
- * circumstances, as_prepare_load and as_complete_load probably don't
- * need to do anything.
- *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Segments are demand paged: nothing is read here beyond the headers.
+ * vm_fault reads each page from the executable the first time it is
+ * touched, and zero-fills the part of the segment past its file data.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -60,91 +56,6 @@
 #include <vnode.h>
 #include <elf.h>
 
-/*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
- *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
- */
-static
-int
-load_segment(struct addrspace *as, struct vnode *v,
-	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
-{
-	struct iovec iov;
-	struct uio u;
-	int result;
-
-	if (filesize > memsize) {
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
-	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
-}
-
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -243,11 +154,15 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) ph.p_filesz, (unsigned long) ph.p_vaddr);
+
+		result = as_define_file_region(as,
+					       ph.p_vaddr, ph.p_memsz,
+					       v, ph.p_offset, ph.p_filesz,
+					       ph.p_flags & PF_R,
+					       ph.p_flags & PF_W,
+					       ph.p_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -258,44 +173,6 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
-	/*
-	 * Now actually load each segment.
-	 */
-
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
-
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
-		}
-
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
-		if (result) {
-			return result;
-		}
-	}
-
 	result = as_complete_load(as);
 	if (result) {
 		return result;
@@ -37,6 +37,8 @@
 #include <kern/limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <kern/unistd.h>
+#include <kern/vmstat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -47,6 +49,8 @@
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <addrspace.h>
+#include <vm.h>
 #include <syscall.h>
 
 /*
@@ -387,7 +391,11 @@ sys_fsync(int fd)
 	 * and we're not using any of its non-constant fields.
 	 */
 
-	err = VOP_FSYNC(file->of_vnode);
+	/* pages we have mapped from the file go out first */
+	err = as_sync(proc_getas(), file->of_vnode);
+	if (!err) {
+		err = VOP_FSYNC(file->of_vnode);
+	}
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
@@ -427,3 +435,85 @@ sys_ftruncate(int fd, off_t len)
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
+
+/*
+ * mmap - map part of a file into a new region of the address space.
+ * Changes are written back to the file (see as_sync), so writeable
+ * mappings need a file open for both reading and writing.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval)
+{
+	struct openfile *file;
+	struct stat st;
+	size_t filesize;
+	vaddr_t addr;
+	int err;
+
+	if (length == 0 || offset < 0 || (offset & (PAGE_SIZE - 1)) != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	/* of_accmode should have only the O_ACCMODE bits in it */
+	KASSERT((file->of_accmode & O_ACCMODE) == file->of_accmode);
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	err = VOP_MMAP(file->of_vnode);
+	if (err) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return err;
+	}
+
+	/* pages past the end of the file are zero-filled and never written */
+	err = VOP_STAT(file->of_vnode, &st);
+	if (err) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return err;
+	}
+	filesize = 0;
+	if (st.st_size > offset) {
+		filesize = st.st_size - offset < (off_t)length ?
+			st.st_size - offset : length;
+	}
+
+	err = as_mmap(proc_getas(), length, (prot & PROT_WRITE) != 0,
+		      file->of_vnode, offset, filesize, &addr);
+	filetable_put(curproc->p_filetable, fd, file);
+	if (err) {
+		return err;
+	}
+	*retval = (int)addr;
+	return 0;
+}
+
+/*
+ * munmap - write back and remove a mapping made by mmap
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	return as_munmap(proc_getas(), (vaddr_t)addr);
+}
+
+/*
+ * __vmstat - copy out the VM statistics (see kern/vmstat.h)
+ */
+int
+sys___vmstat(userptr_t buf)
+{
+	struct vmstat vs;
+
+	vm_getstats(&vs);
+	return copyout(&vs, buf, sizeof(vs));
+}
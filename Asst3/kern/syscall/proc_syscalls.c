@@ -42,6 +42,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <pid.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 /* note that sys_execv is in runprogram.c */
@@ -157,3 +158,26 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_sbrk
+ * move the end of the heap; the address space does the work.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int)oldbreak;
+	return 0;
+}
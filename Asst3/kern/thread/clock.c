@@ -50,8 +50,7 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	1	/* Reschedule every hardclock. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -97,13 +96,10 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+		/* yields if the current thread's quantum is up */
 		schedule();
 	}
-	thread_yield();
 }
 
 /*
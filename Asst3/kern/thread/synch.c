@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -138,31 +140,56 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from an object cache, and keep their wait channel and
+ * spinlock while they sit there unused.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
 		return NULL;
 	}
 
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
 
 	return lock;
@@ -174,11 +201,13 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
+	/* the wait channel is kept, so check it is idle now */
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(wchan_isempty(lock->lk_wchan, &lock->lk_lock));
+	spinlock_release(&lock->lk_lock);
 
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(&lock_cache, lock);
 }
 
 void
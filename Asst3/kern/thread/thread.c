@@ -39,6 +39,7 @@
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -52,7 +53,9 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <vm.h>
 #include <pid.h>
+#include "opt-unsw.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -69,6 +72,12 @@ DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
 static struct cpuarray allcpus;
 
+/* Work stealing, for idle cpus; see below. */
+static bool thread_steal(void);
+
+/* Scheduler priority boosts so far; see schedule(). */
+static volatile unsigned mlfq_epoch;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -144,6 +153,9 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_level = 0;
+	thread->t_ticks = 0;
+	thread->t_epoch = mlfq_epoch;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -182,9 +194,11 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_stealrand = 2463534242U + hardware_number; /* any nonzero */
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
+	c->c_boost_epoch = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -445,6 +459,87 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Cheap per-cpu random numbers (xorshift) for picking work-stealing
+ * victims. Called with interrupts off.
+ */
+static
+uint32_t
+steal_random(void)
+{
+	uint32_t x;
+
+	x = curcpu->c_stealrand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	curcpu->c_stealrand = x;
+	return x;
+}
+
+/*
+ * Wake up an idle cpu, if there is one, so that it can steal work.
+ * c_isidle is read without the run queue locks; if we miss a cpu, it
+ * looks for work again at its next hardclock anyway.
+ */
+static
+void
+thread_kick_idle(void)
+{
+	unsigned i, numcpus, start;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	start = steal_random();
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Apply any priority boost T has missed, e.g. while it was asleep.
+ */
+static
+void
+mlfq_catch_up(struct thread *t)
+{
+	if (t->t_epoch != mlfq_epoch) {
+		t->t_epoch = mlfq_epoch;
+		t->t_level = 0;
+		t->t_ticks = 0;
+	}
+}
+
+/*
+ * Put T on C's run queue behind every thread of the same or a higher
+ * priority level, so that the queue stays in MLFQ order and threads
+ * of one level take turns. The caller holds C's run queue lock.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	mlfq_catch_up(t);
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_self != NULL; tln = tln->tln_prev) {
+		if (tln->tln_self->t_level <= t->t_level) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -469,7 +564,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -478,6 +573,15 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_runqueue.tl_count > (already_have_lock ? 1 : 0)) {
+		/*
+		 * More threads are ready here than the cpu can run
+		 * right now. (With the lock already held, the target
+		 * is curthread yielding, and the cpu is about to take
+		 * one of the others.) Let an idle cpu steal them.
+		 */
+		thread_kick_idle();
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -639,6 +743,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal work from other cpus
+	 * (see thread_steal), then zero frames for the VM system one
+	 * at a time, checking the runqueue between them. Interrupts are
+	 * on while each frame is zeroed.
 	 */
 
 	/* The current cpu is now idle. */
@@ -647,7 +756,26 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+#if OPT_UNSW
+				bool refilled;
+
+				/*
+				 * Zero the page with interrupts on, so
+				 * the clock and shootdown IPIs are not
+				 * held off; they see c_isidle and leave
+				 * this thread alone.
+				 */
+				spl0();
+				refilled = frame_zero_refill();
+				splhigh();
+				if (!refilled) {
+					cpu_idle();
+				}
+#else
+				cpu_idle();
+#endif
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -821,139 +949,168 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, and run queues are kept ordered by level (runqueue_insert),
+ * so the highest-priority ready thread always runs next.
+ *
+ *   - New threads start at level 0.
+ *   - A thread that uses up its level's quantum, counted in calls to
+ *     schedule() and whether or not it slept in between, is moved
+ *     down a level and preempted. Quanta grow with the level, so
+ *     CPU-bound threads sink and run in longer slices, while threads
+ *     that mostly wait for I/O stay near the top.
+ *   - A thread is also preempted when a thread of a higher level is
+ *     waiting on its CPU.
+ *   - Every MLFQ_BOOST_HARDCLOCKS cpu 0 starts a new boost epoch,
+ *     and all threads go back to level 0, so that nothing starves
+ *     and threads that change from CPU-bound to interactive get
+ *     their priority back. Each cpu boosts its run queue and current
+ *     thread at its next hardclock; a sleeping thread is boosted
+ *     when it is put on a run queue again (mlfq_catch_up).
+ *
+ * This is called periodically from hardclock().
  */
 
+static const unsigned mlfq_quantum[MLFQ_LEVELS] = { 1, 2, 4, 8 };
+
+#define MLFQ_BOOST_HARDCLOCKS	HZ	/* once a second */
+
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur = curthread;
+	struct threadlistnode *tln;
+	bool preempt;
+
+	if (curcpu->c_number == 0 &&
+	    (curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS) == 0) {
+		mlfq_epoch++;
+	}
+
+	/* nothing to charge if this cpu is idling */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	if (curcpu->c_boost_epoch != mlfq_epoch) {
+		/* queue order is still right: all are now level 0 */
+		curcpu->c_boost_epoch = mlfq_epoch;
+		for (tln = curcpu->c_runqueue.tl_head.tln_next;
+		     tln->tln_self != NULL; tln = tln->tln_next) {
+			tln->tln_self->t_epoch = mlfq_epoch;
+			tln->tln_self->t_level = 0;
+			tln->tln_self->t_ticks = 0;
+		}
+	}
+	mlfq_catch_up(cur);
+
+	cur->t_ticks++;
+	preempt = false;
+	if (cur->t_ticks >= mlfq_quantum[cur->t_level]) {
+		if (cur->t_level < MLFQ_LEVELS - 1) {
+			cur->t_level++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+
+	tln = curcpu->c_runqueue.tl_head.tln_next;
+	if (tln->tln_self != NULL && tln->tln_self->t_level < cur->t_level) {
+		preempt = true;
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
- * Thread migration.
+ * Work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * A cpu whose run queue is empty calls this from thread_switch
+ * before idling. It takes half (rounded up) of the threads from the
+ * tail of another cpu's run queue, which in MLFQ order holds the
+ * lowest-priority threads. Victims are tried starting from a random
+ * cpu, so that idle cpus don't all descend on the same one; busy
+ * cpus wake idle ones (thread_kick_idle) when work piles up.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Only one run queue lock is held at a time, and run queues that
+ * look empty are skipped without locking them. Returns true if any
+ * threads were stolen.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Migrating threads isn't free because of cache affinity, but
+ * System/161 does not (yet) model such cache effects, so we steal
+ * as soon as we run dry.
  */
-void
-thread_consider_migration(void)
+static
+bool
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned i, n, numcpus, start;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct threadlist stolen;
+	struct thread *t, *skipped;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
-
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (numcpus < 2) {
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	threadlist_init(&stolen);
+	start = steal_random();
+	for (i=0; i < numcpus && threadlist_isempty(&stolen); i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c == curcpu->c_self || c->c_runqueue.tl_count == 0) {
 			continue;
 		}
+
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+		skipped = NULL;
+		n = DIVROUNDUP(c->c_runqueue.tl_count, 2);
+		while (n-- > 0) {
+			t = threadlist_remtail(&c->c_runqueue);
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * Ordinarily, a cpu's curthread will not appear
+			 * on its run queue. However, it can if it went
+			 * to sleep, the cpu went idle so it remained
+			 * curthread, and it was woken again before the
+			 * cpu fully unidled. Taking it would run it on
+			 * two cpus at once, so leave it be.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (t == c->c_curthread) {
+				KASSERT(skipped == NULL);
+				skipped = t;
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			t->t_cpu = curcpu->c_self;
+			threadlist_addhead(&stolen, t);
 			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+			      "Stole thread %s: cpu %u -> %u",
+			      t->t_name, c->c_number, curcpu->c_number);
+		}
+		if (skipped != NULL) {
+			runqueue_insert(c, skipped);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (threadlist_isempty(&stolen)) {
+		threadlist_cleanup(&stolen);
+		return false;
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		runqueue_insert(curcpu, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&stolen);
+	return true;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1167,6 +1324,25 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to each CPU in CPUS but this one.
+ */
+unsigned
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((cpus & ((uint32_t)1 << i)) && c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -27,17 +27,24 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 #include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <swap.h>
+#include <kmemcache.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -49,6 +56,51 @@
  *
  */
 
+/*
+ * Frames let go of together, by as_destroy and as_release_pages, go
+ * back to the frame table this many at a time.
+ */
+#define FREE_BATCH 64
+
+static void
+free_batch_add(struct addrspace *as, paddr_t *batch, unsigned *n,
+	       paddr_t paddr)
+{
+	batch[(*n)++] = paddr;
+	if (*n == FREE_BATCH) {
+		frame_free_batch(batch, *n, as);
+		*n = 0;
+	}
+}
+
+/*
+ * Object caches for address spaces and regions. A cached address
+ * space keeps its page table lock; page tables are whole pages and
+ * come straight from alloc_kpages.
+ */
+static int
+as_ctor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	as->pt_lock = lock_create("lock for page table");
+	return as->pt_lock == NULL ? ENOMEM : 0;
+}
+
+static void
+as_dtor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	lock_destroy(as->pt_lock);
+}
+
+static struct kmem_cache as_cache =
+	KMEM_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace),
+			       as_ctor, as_dtor);
+static struct kmem_cache region_cache =
+	KMEM_CACHE_INITIALIZER("region", sizeof(struct region), NULL, NULL);
+
 /*
  * allocate a data structure used to keep track of
  * an address space
@@ -58,7 +110,7 @@ as_create(void)
 {
 
 	struct addrspace *as;
-	as = kmalloc(sizeof(struct addrspace));
+	as = kmem_cache_alloc(&as_cache);
 	if (as == NULL) {
 		return NULL;
 	}
@@ -66,18 +118,31 @@ as_create(void)
 	/*
 	 * Initialize as needed.
 	 */
-	as->head = NULL; /* region initialisation */
+	regionarray_init(&as->as_regions); /* region initialisation */
+	as->as_lastregion = NULL;
 	/* PD initialisation */
-	paddr_t **pd = kmalloc(PAGETABLE_SIZE * 4);
+	paddr_t **pd = (paddr_t **) alloc_kpages(1);
 	if(pd == NULL) {
-		kfree(as);
+		kmem_cache_free(&as_cache, as);
 		return NULL;
 	}
 	as->pagetable = pd;
+	as->pt_count = kmalloc(PAGETABLE_SIZE * sizeof(uint16_t));
+	if (as->pt_count == NULL) {
+		free_kpages((vaddr_t) pd);
+		kmem_cache_free(&as_cache, as);
+		return NULL;
+	}
 	for (int i = 0; i < PAGETABLE_SIZE; i++) {
 		pd[i] = NULL;
+		as->pt_count[i] = 0;
 	}
-	as->pt_lock = lock_create("lock for page table"); /* pd lock initialisation */
+	as->as_asid = 0; /* assigned when first activated */
+	as->as_asid_gen = 0;
+	as->as_cpus = 0;
+	as->as_heap = NULL; /* set by as_complete_load */
+	as->as_heapend = 0;
+	as->as_stack = NULL; /* set by as_define_stack */
 
 	return as;
 }
@@ -86,9 +151,8 @@ as_create(void)
  * allocates a new (destination) address space
  * adds all the same regions as source
  * roughly, for each mapped page in source
- * - allocate a frame in dest
- * - copy contents from source frame to dest frame
- * - add PT entry for dest
+ * - share the source frame with dest (copy-on-write)
+ * - add read-only PT entries for both source and dest
  */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
@@ -102,46 +166,60 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 	
+	/*
+	 * pt_copy clears TLBLO_DIRTY, which is all that says a mapped
+	 * page was modified, so write those pages back first.
+	 */
+	int result = as_sync(old, NULL);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
+
 	/*
 	 * get all data from old and copy them into new
 	 * Have to allocate memory for anything that we copy
 	 * prolly a good idea to lock what we are trying to copy here
 	 */
 	lock_acquire(old->pt_lock);
-	/* copy head region */
-	struct region *old_curr = old->head;
-	struct region *new_curr = newas->head;
-
-	while(old_curr != NULL)	{
-		struct region * new_region = kmalloc(sizeof(struct region));
+	/* copy the regions; they are already in order */
+	unsigned num = regionarray_num(&old->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *old_region = regionarray_get(&old->as_regions, i);
+		struct region *new_region = kmem_cache_alloc(&region_cache);
 		if(new_region == NULL) {
-			as_destroy(newas);
 			lock_release(old->pt_lock);
+			as_destroy(newas);
 			return ENOMEM;
 		}
 
-		region_copy(old_curr, new_region);
-		/* check if we are dealing with starting node */
-		if(new_curr != NULL) {
-			new_curr->next = new_region;
-		} else {
-			newas->head = new_region;
+		region_copy(old_region, new_region);
+		if (regionarray_add(&newas->as_regions, new_region, NULL)) {
+			kmem_cache_free(&region_cache, new_region);
+			lock_release(old->pt_lock);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		if (old_region == old->as_heap) {
+			newas->as_heap = new_region;
+		}
+		if (old_region == old->as_stack) {
+			newas->as_stack = new_region;
 		}
-		new_curr = new_region;
-		old_curr = old_curr->next;
 	}
 
-
-
-
 	/* Copy pt into new*/
-	 if(pt_copy(old, old->pagetable, newas->pagetable) != 0)
+	 if(pt_copy(old->pagetable, newas->pagetable, newas->pt_count) != 0)
 	 {
-		as_destroy(newas);
+		vm_tlbshoot(old, 0, USERSPACETOP);
 		lock_release(old->pt_lock);
+		as_destroy(newas);
 		return ENOMEM;
 	 }
 
+	newas->as_heapend = old->as_heapend;
+	/* the parent may still hold writeable TLB entries for shared pages */
+	vm_tlbshoot(old, 0, USERSPACETOP);
 	lock_release(old->pt_lock);
 	*ret = newas;
 	return 0;
@@ -149,6 +227,8 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 /*
  * deallocate book keeping and page tables
  * - deallocate the frames used
+ * Only the tables in use are looked at, each only until its last
+ * entry in use, and the frames go back in batches.
  */
 void
 as_destroy(struct addrspace *as)
@@ -156,30 +236,60 @@ as_destroy(struct addrspace *as)
 	/*
       * Clean up as needed.
       */
+	/*
+	 * Mapped files are written back as if they were unmapped. There
+	 * is no process left to return a failure to, so it is reported
+	 * here and the pages are thrown away regardless.
+	 */
+	int result = as_sync(as, NULL);
+	if (result) {
+		kprintf("vm: writing back mappings on exit: %s\n",
+			strerror(result));
+	}
 	/* Have to verify that the addrspace isnt used atm */
+	/* and that swap_evict is not looking at one of our frames */
+	vm_asid_release(as);
+	swap_lock_acquire();
 	lock_acquire(as->pt_lock);
 	/* free pagetable in a 2 level table fashion */
+	paddr_t batch[FREE_BATCH];
+	unsigned nbatch = 0;
 	for (int i = 0; i < PAGETABLE_SIZE; i++) {
 		if (as->pagetable[i] != NULL) {
-			for(int j = 0; j < PAGETABLE_SIZE; j++) {
-				if(as->pagetable[i][j] != EMPTY) {
-					free_kpages(PADDR_TO_KVADDR(as->pagetable[i][j]) & PAGE_FRAME);
+			unsigned left = as->pt_count[i];
+			for(int j = 0; left > 0 && j < PAGETABLE_SIZE; j++) {
+				paddr_t pte = as->pagetable[i][j];
+				if (pte == EMPTY) {
+					continue;
+				}
+				left--;
+				if(pte & PTE_SWAPPED) {
+					swap_free(PTE_TO_SLOT(pte));
+				} else {
+					free_batch_add(as, batch, &nbatch, pte & PAGE_FRAME);
 				}
 			}
-			kfree(as->pagetable[i]);
+			free_kpages((vaddr_t) as->pagetable[i]);
 		}
 	}
-	kfree(as->pagetable);
-	/* free region in a linked list fashio */
-	regions_cleanup(as);
+	frame_free_batch(batch, nbatch, as);
+	free_kpages((vaddr_t) as->pagetable);
+	kfree(as->pt_count);
 	lock_release(as->pt_lock);
-	lock_destroy(as->pt_lock);
-	kfree(as);
+	swap_lock_release();
+	/*
+	 * free the regions; the last VOP_DECREF can take vfs_biglock,
+	 * whose holder may be waiting in swap_evict for swap_lock
+	 */
+	regions_cleanup(as);
+	regionarray_cleanup(&as->as_regions);
+	/* the cached object keeps its pt_lock */
+	kmem_cache_free(&as_cache, as);
 }
 
 /*
- * flush TLB (or set the hardware asid)
- * use what is from dumbvm
+ * set the hardware asid
+ * entries of other address spaces stay in the TLB, tagged with theirs
  */
 void
 as_activate(void)
@@ -195,22 +305,13 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * From dumbvm.c
-	 * Disable interrupts on this CPU while frobbing the TLB.
-	 * its zeroing out the tlb
-	 */
-	int spl = splhigh();
-
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	VMSTAT_INC(vs_activates);
+	vm_asid_activate(as);
 }
 
 /*
- * flush TLB (or flush an asid)
+ * nothing to flush: a dead address space's asid is never handed out
+ * again in the same generation, so its stale TLB entries cannot match
  */
 void
 as_deactivate(void)
@@ -219,9 +320,7 @@ as_deactivate(void)
 	 * Write this. For many designs it won't need to actually do
 	 * anything. See proc.c for an explanation of why it (might)
 	 * be needed.
-	 * in what circumstances do we need this? Just flush
 	 */
-    as_activate();
 }
 
 /*
@@ -263,69 +362,353 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	
 	struct region *new = region_create(vaddr, memsize, readable, writeable, executable);
 	if (new == NULL) return ENOMEM;
-	region_insert(as, new);
+	result = region_insert(as, new);
+	if (result) {
+		kmem_cache_free(&region_cache, new);
+	}
+	return result;
+}
+
+/*
+ * Set up a region whose contents come from the file V. FILESIZE bytes
+ * starting at file offset OFFSET appear at VADDR; the rest of the
+ * region up to MEMSIZE is zero-filled. Nothing is read here: vm_fault
+ * fills each page the first time it is touched, so the region holds a
+ * reference to the vnode until it is cleaned up.
+ */
+int
+as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		      struct vnode *v, off_t offset, size_t filesize,
+		      int readable, int writeable, int executable)
+{
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	int result = as_define_region(as, vaddr, memsize,
+				      readable, writeable, executable);
+	if (result) {
+		return result;
+	}
+
+	struct region *region = get_region(as, vaddr & PAGE_FRAME);
+	KASSERT(region != NULL);
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = vaddr;
+	region->filesize = filesize;
 	return 0;
 }
 
 /*
- * make READONLY regions READWRITE for loading
- * purposes
+ * Nothing to do: pages are filled through their kernel address by
+ * vm_fault, so READONLY regions never need to be made writeable for
+ * loading.
  */
 int
 as_prepare_load(struct addrspace *as)
 {
-	struct region *curr = as->head;
-	while(curr != NULL) {
-		curr->old_writeable = curr->writeable;
-		curr->writeable = 1;
-		curr = curr->next;
+	(void)as;
+	return 0;
+}
+
+/*
+ * Nothing has been loaded yet (see as_prepare_load), so there are
+ * no page table entries to fix up. Now that every segment is defined,
+ * start the heap as an empty region just above the highest one.
+ */
+int
+as_complete_load(struct addrspace *as)
+{
+	vaddr_t top = 0;
+	unsigned num = regionarray_num(&as->as_regions);
+
+	if (num > 0) {
+		/* regions are sorted and disjoint, so the last ends highest */
+		struct region *last = regionarray_get(&as->as_regions, num - 1);
+		top = last->base_addr + last->memsize;
+	}
+
+	struct region *heap = region_create(top, 0, 1, 1, 0);
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+	if (region_insert(as, heap)) {
+		kmem_cache_free(&region_cache, heap);
+		return ENOMEM;
 	}
+	as->as_heap = heap;
+	as->as_heapend = top;
+	return 0;
+}
 
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+
+	int result;
+
+	/* Initial user-level stack pointer */
+	*stackptr = USERSTACK;
+
+	result = as_define_region(as, *stackptr - USER_STACK_SIZE, USER_STACK_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_stack = get_region(as, *stackptr - 1);
 	return 0;
 }
 
 /*
- * enforce READONLY again
+ * Called by vm_fault for a fault outside every region. If VADDR is
+ * below the stack and within vm_stack_limit of its top, move the base
+ * of the stack down to VADDR's page, provided the page below that
+ * still belongs to no region: touching it is then a clean fault, not
+ * a write into whatever the stack ran into. Nothing is allocated;
+ * the new pages are zero-filled on first touch like any other.
  */
 int
-as_complete_load(struct addrspace *as)
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
 {
-	as_activate(); //Flush after loading
+	struct region *stack = as->as_stack;
+	vaddr_t base = vaddr & PAGE_FRAME;
+
+	if (stack == NULL || vaddr >= stack->base_addr ||
+	    USERSTACK - base > vm_stack_limit || base < PAGE_SIZE) {
+		return EFAULT;
+	}
+	/* the guard page goes with the new pages */
+	if (region_valid(as, base - PAGE_SIZE, stack->base_addr - base + PAGE_SIZE)) {
+		return EFAULT;
+	}
+
+	stack->memsize += stack->base_addr - base;
+	stack->base_addr = base;
+	return 0;
+}
+
+/*
+ * Move the break by AMOUNT bytes and hand back the old one. The heap
+ * region always covers the whole pages below the break; new pages are
+ * zero-filled by vm_fault on first touch, and pages dropped by a
+ * negative AMOUNT are freed straight away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->as_heap;
+	vaddr_t oldtop, newtop, newbreak;
+
+	if (heap == NULL) {
+		return EINVAL;
+	}
+
+	*oldbreak = as->as_heapend;
+	if (amount < 0) {
+		if ((vaddr_t)-amount > as->as_heapend - heap->base_addr) {
+			return EINVAL;
+		}
+	} else if ((vaddr_t)amount > MIPS_KSEG0 - as->as_heapend) {
+		return ENOMEM;
+	}
+	newbreak = as->as_heapend + amount;
+
+	oldtop = heap->base_addr + heap->memsize;
+	newtop = (newbreak + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (newtop > oldtop) {
+		/*
+		 * must not run into the stack or anything else, and
+		 * must leave a guard page below it
+		 */
+		if (region_valid(as, oldtop, newtop - oldtop + PAGE_SIZE)) {
+			return ENOMEM;
+		}
+	} else if (newtop < oldtop) {
+		as_release_pages(as, newtop, oldtop);
+	}
+
+	heap->memsize = newtop - heap->base_addr;
+	as->as_heapend = newbreak;
+	return 0;
+}
+
+/*
+ * Throw away the pages of AS in [START, END). Resident frames are
+ * freed (or unshared) and swap slots released; the entries are left
+ * empty, so the range zero-fills again if it is ever touched.
+ * Resident pages are first made invalid, so that one shootdown for
+ * the whole range can clear the TLBs before any frame is let go.
+ */
+void
+as_release_pages(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	paddr_t batch[FREE_BATCH];
+	unsigned nbatch = 0;
+
+	/* keep swap_evict away from the frames while we free them */
+	swap_lock_acquire();
 	lock_acquire(as->pt_lock);
-	paddr_t **pt = as->pagetable;
-	for(int i = 0; i < PAGETABLE_SIZE; i++) {
-		if (pt[i] != NULL) {
-			for(int j = 0; j < PAGETABLE_SIZE; j++) {
-				if (pt[i][j] != EMPTY) {
-					vaddr_t pd_bits = i << 22;
-					vaddr_t pt_bits = j << 12;
-					vaddr_t vaddr = pd_bits|pt_bits;
-					struct region *region = get_region(as, vaddr);
-					if (region->old_writeable == 0) {
-						pt[i][j] = (pt[i][j] & PAGE_FRAME) | TLBLO_VALID;
-					}
-				}
-			}
+	for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+		paddr_t *table = as->pagetable[get_first_10_bits(va)];
+		if (table == NULL) {
+			continue;
+		}
+		paddr_t *pte = &table[get_middle_10_bits(va)];
+		if ((*pte & PTE_SWAPPED) == 0) {
+			*pte &= ~TLBLO_VALID;
+		}
+	}
+	vm_tlbshoot(as, start, end);
+	for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+		paddr_t *table = as->pagetable[get_first_10_bits(va)];
+		if (table == NULL) {
+			continue;
+		}
+		paddr_t *pte = &table[get_middle_10_bits(va)];
+		if (*pte == EMPTY) {
+			continue;
+		}
+		if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_TO_SLOT(*pte));
+		} else {
+			free_batch_add(as, batch, &nbatch, *pte & PAGE_FRAME);
 		}
+		*pte = EMPTY;
+		as->pt_count[get_first_10_bits(va)]--;
 	}
+	frame_free_batch(batch, nbatch, as);
 	lock_release(as->pt_lock);
-	struct region *curr = as->head;
-	while(curr != NULL) {
-		curr->writeable = curr->old_writeable;
-		curr = curr->next;
+	swap_lock_release();
+}
+
+/*
+ * Map FILESIZE bytes of V starting at OFFSET into a new region of
+ * LENGTH bytes. Mappings are placed top-down in the first gap below
+ * the stack (and any earlier mappings), with a free page above each
+ * one. Nothing is read until the pages are touched.
+ */
+int
+as_mmap(struct addrspace *as, size_t length, int writeable,
+	struct vnode *v, off_t offset, size_t filesize, vaddr_t *ret)
+{
+	vaddr_t top, base, floor;
+	size_t memsize;
+
+	memsize = (length + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (memsize == 0) {
+		return EINVAL;
 	}
-	
+
+	/*
+	 * walk down from the top until a gap is big enough, leaving
+	 * the stack room to grow to its limit
+	 */
+	floor = (as->as_heapend + PAGE_SIZE - 1) & PAGE_FRAME;
+	top = USERSTACK - vm_stack_limit - PAGE_SIZE;
+	for (unsigned i = regionarray_num(&as->as_regions); i > 0; i--) {
+		struct region *curr = regionarray_get(&as->as_regions, i - 1);
+		vaddr_t end = curr->base_addr + curr->memsize;
+		if (top >= end && top - end >= memsize + PAGE_SIZE) {
+			break;
+		}
+		if (curr->base_addr < top) {
+			top = curr->base_addr;
+		}
+	}
+	if (top < floor || top - floor < memsize + PAGE_SIZE) {
+		return ENOMEM;
+	}
+	base = top - memsize - PAGE_SIZE;
+
+	struct region *region = region_create(base, memsize, 1, writeable, 0);
+	if (region == NULL) {
+		return ENOMEM;
+	}
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = base;
+	region->filesize = filesize < memsize ? filesize : memsize;
+	region->mapped = 1;
+	if (region_insert(as, region)) {
+		VOP_DECREF(v);
+		kmem_cache_free(&region_cache, region);
+		return ENOMEM;
+	}
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Write back and drop the mapping that starts at VADDR. If the write
+ * back fails the mapping is left alone so that nothing is lost.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *curr;
+	int result;
+
+	curr = get_region(as, vaddr);
+	if (curr == NULL || !curr->mapped || curr->base_addr != vaddr) {
+		return EINVAL;
+	}
+
+	vaddr_t scratch = alloc_kpages(1);
+	if (scratch == 0) {
+		return ENOMEM;
+	}
+	result = region_writeback(as, curr, scratch);
+	free_kpages(scratch);
+	if (result) {
+		return result;
+	}
+
+	as_release_pages(as, curr->base_addr, curr->base_addr + curr->memsize);
+	region_remove(as, curr);
+	VOP_DECREF(curr->vnode);
+	kmem_cache_free(&region_cache, curr);
 	return 0;
 }
 
+/*
+ * Write back every mapping of V, or every mapping if V is NULL.
+ */
 int
-as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+as_sync(struct addrspace *as, struct vnode *v)
 {
+	struct region *curr;
+	vaddr_t scratch = 0;
+	unsigned i, num;
+	int result = 0;
 
-	/* Initial user-level stack pointer */
-	*stackptr = USERSTACK;
+	num = regionarray_num(&as->as_regions);
+	for (i = 0; i < num; i++) {
+		curr = regionarray_get(&as->as_regions, i);
+		if (curr->mapped && (v == NULL || curr->vnode == v)) {
+			break;
+		}
+	}
+	if (i == num) {
+		/* the usual case: nothing mapped */
+		return 0;
+	}
 
-	return as_define_region(as, *stackptr - USER_STACK_SIZE, USER_STACK_SIZE, 1, 1, 0);
+	scratch = alloc_kpages(1);
+	if (scratch == 0) {
+		return ENOMEM;
+	}
+	for (; i < num && result == 0; i++) {
+		curr = regionarray_get(&as->as_regions, i);
+		if (curr->mapped && (v == NULL || curr->vnode == v)) {
+			result = region_writeback(as, curr, scratch);
+		}
+	}
+	free_kpages(scratch);
+	return result;
 }
 
 /*
@@ -334,22 +717,83 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 struct region * region_create(vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable) {
 
-	struct region *new = kmalloc(sizeof(struct region));
+	struct region *new = kmem_cache_alloc(&region_cache);
 	if (new != NULL) {
 		new->base_addr = vaddr;
 		new->memsize = memsize;
 		new->readable = readable;
 		new->writeable = writeable;
 		new->executable = executable;
-		new->next = NULL;
+		new->vnode = NULL;
+		new->file_offset = 0;
+		new->file_vaddr = 0;
+		new->filesize = 0;
+		new->mapped = 0;
 	}
 
 	return new;
 }
 
-void region_insert(struct addrspace *as, struct region *new) {
-	new->next = as->head;
-	as->head = new;
+/*
+ * Count the regions that start below VADDR, i.e. the index of the
+ * first one that starts at or above it. Regions never overlap and an
+ * empty region sorts before a non-empty one at the same address, so
+ * the ends are in order too and the region just before that index is
+ * the only one that can contain VADDR - 1.
+ */
+unsigned region_search(struct addrspace *as, vaddr_t vaddr) {
+	unsigned lo = 0;
+	unsigned hi = regionarray_num(&as->as_regions);
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		struct region *r = regionarray_get(&as->as_regions, mid);
+		if (r->base_addr < vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Add NEW in order; the caller has checked it overlaps nothing */
+int region_insert(struct addrspace *as, struct region *new) {
+	unsigned num = regionarray_num(&as->as_regions);
+	unsigned i = region_search(as, new->base_addr);
+
+	/* keep an empty heap ahead of a mapping at the same address */
+	while (new->memsize != 0 && i < num &&
+	       regionarray_get(&as->as_regions, i)->base_addr == new->base_addr &&
+	       regionarray_get(&as->as_regions, i)->memsize == 0) {
+		i++;
+	}
+
+	int result = regionarray_add(&as->as_regions, new, NULL);
+	if (result) {
+		return result;
+	}
+	for (unsigned j = num; j > i; j--) {
+		regionarray_set(&as->as_regions, j,
+				regionarray_get(&as->as_regions, j - 1));
+	}
+	regionarray_set(&as->as_regions, i, new);
+	return 0;
+}
+
+/* Take REGION out of AS; the caller frees it */
+void region_remove(struct addrspace *as, struct region *region) {
+	unsigned num = regionarray_num(&as->as_regions);
+
+	for (unsigned i = region_search(as, region->base_addr); i < num; i++) {
+		if (regionarray_get(&as->as_regions, i) == region) {
+			regionarray_remove(&as->as_regions, i);
+			break;
+		}
+	}
+	if (as->as_lastregion == region) {
+		as->as_lastregion = NULL;
+	}
 }
 
 
@@ -358,38 +802,185 @@ void region_copy(struct region *old, struct region *new) {
 	new->memsize = old->memsize;
 	new->readable = old->readable;
 	new->writeable = old->writeable;
-	new->old_writeable = old->old_writeable;
 	new->executable = old->executable;
-	new->next = NULL;
+	new->vnode = old->vnode;
+	if (new->vnode != NULL) {
+		VOP_INCREF(new->vnode);
+	}
+	new->file_offset = old->file_offset;
+	new->file_vaddr = old->file_vaddr;
+	new->filesize = old->filesize;
+	new->mapped = old->mapped;
+}
+
+/*
+ * Fill the frame at KVADDR with the page of REGION containing VADDR.
+ * Bytes backed by the region's file are read from it; only the parts
+ * of the page outside the file data (the BSS tail) are zeroed.
+ */
+int region_fill(struct region *region, vaddr_t vaddr, vaddr_t kvaddr) {
+	vaddr_t page = vaddr & PAGE_FRAME;
+	vaddr_t start = page;
+	vaddr_t end = page + PAGE_SIZE;
+	vaddr_t file_end = region->file_vaddr + region->filesize;
+
+	if (region_zero_page(region, vaddr)) {
+		bzero((void *) kvaddr, PAGE_SIZE);
+		return 0;
+	}
+
+	if (start < region->file_vaddr) {
+		start = region->file_vaddr;
+	}
+	if (end > file_end) {
+		end = file_end;
+	}
+
+	/* zero whatever the file does not cover */
+	bzero((void *) kvaddr, start - page);
+	bzero((void *) (kvaddr + (end - page)), page + PAGE_SIZE - end);
+
+	struct iovec iov;
+	struct uio u;
+	uio_kinit(&iov, &u, (void *) (kvaddr + (start - page)), end - start,
+		  region->file_offset + (start - region->file_vaddr), UIO_READ);
+	int result = VOP_READ(region->vnode, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* short read; the file shrank under us? */
+		kprintf("vm: short read paging in 0x%lx - file truncated?\n",
+			(unsigned long) page);
+		return region->mapped ? EIO : ENOEXEC;
+	}
+	return 0;
 }
 
 
+/*
+ * True if the page of REGION holding VADDR has no file data in it, so
+ * it starts out all zeroes.
+ */
+bool region_zero_page(struct region *region, vaddr_t vaddr) {
+	vaddr_t page = vaddr & PAGE_FRAME;
+
+	return region->vnode == NULL ||
+	       page + PAGE_SIZE <= region->file_vaddr ||
+	       page >= region->file_vaddr + region->filesize;
+}
+
+/*
+ * If the page of REGION holding VADDR is read-only and wholly file
+ * data, every process running the file sees exactly the same bytes
+ * there, so the frame can be shared through the text cache. Hand
+ * back its file offset, which is the cache key with the vnode.
+ * Pages that are partly zero-fill depend on the segment layout and
+ * stay private, as do writeable and mmap pages.
+ */
+bool region_text_offset(struct region *region, vaddr_t vaddr, uint32_t *offset) {
+	vaddr_t page = vaddr & PAGE_FRAME;
+
+	if (region->vnode == NULL || region->writeable || region->mapped ||
+	    page < region->file_vaddr ||
+	    page + PAGE_SIZE > region->file_vaddr + region->filesize) {
+		return false;
+	}
+	*offset = region->file_offset + (page - region->file_vaddr);
+	return true;
+}
+
+/*
+ * Write the modified pages of the mapped REGION back to its file. A
+ * resident page was modified if it has TLBLO_DIRTY (see vm_fault); a
+ * page on swap might have been, so it is written too. Each page is
+ * copied into SCRATCH under the page table lock and written out after
+ * the lock is dropped, so that faults and page-out in AS never wait
+ * on the file. DIRTY is cleared so that the next write is noticed,
+ * and put back if the write fails. Only the part of the file that
+ * existed at mmap time is written.
+ */
+int region_writeback(struct addrspace *as, struct region *region, vaddr_t scratch) {
+	vaddr_t file_end = region->file_vaddr + region->filesize;
+
+	for (vaddr_t va = region->file_vaddr; va < file_end; va += PAGE_SIZE) {
+		paddr_t *table, *pte, old;
+		int result;
+
+	again:
+		lock_acquire(as->pt_lock);
+		table = as->pagetable[get_first_10_bits(va)];
+		if (table == NULL) {
+			lock_release(as->pt_lock);
+			continue;
+		}
+		pte = &table[get_middle_10_bits(va)];
+		old = *pte;
+		if (old & PTE_SWAPPED) {
+			lock_release(as->pt_lock);
+			result = swap_read(PTE_TO_SLOT(old), scratch);
+			if (result) {
+				return result;
+			}
+			/* the slot may have been given up while it was read */
+			lock_acquire(as->pt_lock);
+			bool moved = *pte != old;
+			lock_release(as->pt_lock);
+			if (moved) {
+				goto again;
+			}
+		} else if (old & TLBLO_DIRTY) {
+			/* no writes can slip in once the TLB is clean */
+			*pte &= ~TLBLO_DIRTY;
+			vm_tlbshoot(as, va, va + PAGE_SIZE);
+			memcpy((void *) scratch,
+			       (void *) PADDR_TO_KVADDR(old & PAGE_FRAME),
+			       PAGE_SIZE);
+			lock_release(as->pt_lock);
+		} else {
+			lock_release(as->pt_lock);
+			continue;
+		}
+
+		struct iovec iov;
+		struct uio u;
+		size_t len = file_end - va < PAGE_SIZE ? file_end - va : PAGE_SIZE;
+		uio_kinit(&iov, &u, (void *) scratch, len,
+			  region->file_offset + (va - region->file_vaddr),
+			  UIO_WRITE);
+		result = VOP_WRITE(region->vnode, &u);
+		if (result) {
+			if ((old & PTE_SWAPPED) == 0) {
+				/* keep the page dirty for the next try */
+				lock_acquire(as->pt_lock);
+				if (*pte == (old & ~TLBLO_DIRTY)) {
+					*pte = old;
+				}
+				lock_release(as->pt_lock);
+			}
+			return result;
+		}
+	}
+	return 0;
+}
+
 /*
  * 1) Check if the region is defined within kuseg
- * 2) Check if the region does not overlap other regions
+ * 2) Check if the region does not overlap other regions: of the
+ *    regions starting below its end, the last one ends highest, so
+ *    only that one needs to be looked at.
  */
 int region_valid(struct addrspace *as, vaddr_t vaddr, size_t memsize) {
-	if ((vaddr + memsize) > MIPS_KSEG0) {
+	if ((vaddr + memsize) > MIPS_KSEG0 || vaddr + memsize < vaddr) {
 		return EFAULT;
 	}
 
-	
-	struct region *curr = as->head;
-	while(curr != NULL) {
-		if (curr->base_addr <= vaddr && 
-			(curr->base_addr + curr->memsize) > vaddr) {
+	unsigned i = region_search(as, vaddr + memsize);
+	if (i > 0) {
+		struct region *prev = regionarray_get(&as->as_regions, i - 1);
+		if (prev->base_addr + prev->memsize > vaddr) {
 			return EINVAL; //TODO Check correct error
-		} else if (curr->base_addr <= (vaddr+memsize) && 
-			(curr->base_addr + curr->memsize) > (vaddr+memsize)) {
-			return EINVAL;
-		} else if (vaddr <= curr->base_addr && 
-			(vaddr + memsize) > curr->base_addr) {
-			return EINVAL;
-		} else if (vaddr <= (curr->base_addr + curr->memsize) && 
-			(vaddr + memsize) > (curr->base_addr + curr->memsize)) {
-			return EINVAL;
 		}
-		curr = curr->next;
 	}
 	return 0;
 }
@@ -398,37 +989,57 @@ int region_valid(struct addrspace *as, vaddr_t vaddr, size_t memsize) {
  * 1) Loop through the regions and free
  */
 void regions_cleanup(struct addrspace *as) {
-	struct region *temp;
-	struct region *head = as->head;
-	while(head != NULL) {
-		temp = head;
-		head = head->next;
-		kfree(temp);
+	unsigned num = regionarray_num(&as->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *temp = regionarray_get(&as->as_regions, i);
+		if (temp->vnode != NULL) {
+			VOP_DECREF(temp->vnode);
+		}
+		kmem_cache_free(&region_cache, temp);
 	}
+	regionarray_setsize(&as->as_regions, 0);
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
 }
 
 /* PAGE TABLE HELPER FUNCTION */
-int pt_copy(struct addrspace *old_as, paddr_t **old_pt, paddr_t **new_pt)
+/*
+ * Share every resident page between the two page tables instead of
+ * copying it. Both mappings lose TLBLO_DIRTY so that the first write
+ * from either side traps as VM_FAULT_READONLY, where vm_fault breaks
+ * the sharing. Paged out pages get their own copy of the swap slot.
+ * The caller holds the old address space's pt_lock.
+ */
+int pt_copy(paddr_t **old_pt, paddr_t **new_pt, uint16_t *new_count)
 {
 	for(int i = 0; i < PAGETABLE_SIZE; i++) {
 		if(old_pt[i] != NULL) {
-			new_pt[i] = kmalloc(PAGETABLE_SIZE * 4);
+			new_pt[i] = (paddr_t *) alloc_kpages(1);
 			if(new_pt[i] == NULL) {
 				return ENOMEM;
 			}
 			/* copy everything inside */
 			for(int j = 0; j < PAGETABLE_SIZE; j++)
 			{
-				if(old_pt[i][j] != EMPTY) {
-					/* copy entry */
-					/* allocate frame for this entry */
-					vaddr_t frame_vaddr = alloc_frame(old_as, PADDR_TO_KVADDR(old_pt[i][j]));
-					if(frame_vaddr == 0) return ENOMEM;
-					/* copy contains in old mem into new mem */
-					memmove((void *) frame_vaddr, (void *) PADDR_TO_KVADDR(old_pt[i][j] & PAGE_FRAME), PAGE_SIZE);
-					new_pt[i][j] = KVADDR_TO_PADDR(frame_vaddr) & PAGE_FRAME;
-					/* assign right bits */
-					new_pt[i][j] = new_pt[i][j] | (TLBLO_DIRTY & old_pt[i][j]) | (TLBLO_VALID & old_pt[i][j]);
+				if(old_pt[i][j] & PTE_SWAPPED) {
+					unsigned slot;
+					if(swap_dup(PTE_TO_SLOT(old_pt[i][j]), &slot) != 0) {
+						/* leave the rest empty for as_destroy */
+						for(; j < PAGETABLE_SIZE; j++) {
+							new_pt[i][j] = EMPTY;
+						}
+						return ENOMEM;
+					}
+					new_pt[i][j] = SLOT_TO_PTE(slot);
+					new_count[i]++;
+				} else if(old_pt[i][j] != EMPTY) {
+					/* share the frame, write protect both sides */
+					frame_ref(old_pt[i][j] & PAGE_FRAME);
+					old_pt[i][j] &= ~TLBLO_DIRTY;
+					new_pt[i][j] = old_pt[i][j];
+					new_count[i]++;
+					VMSTAT_INC(vs_ptcopies);
 				} else {
 					new_pt[i][j] = EMPTY;
 				}
@@ -440,5 +1051,3 @@ int pt_copy(struct addrspace *old_as, paddr_t **old_pt, paddr_t **new_pt)
 	}
 	return 0;
 }
-
-
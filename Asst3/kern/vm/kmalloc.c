@@ -30,7 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 #include <vm.h>
+#include <kmemcache.h>
+#include "opt-unsw.h"
 
 /*
  * Kernel malloc.
@@ -121,6 +126,18 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * Per-CPU magazines and multi-page slabs (see below) need the frame
+ * table's page tags, which only the UNSW allocator keeps. Magazines
+ * would also hide blocks from the GUARDS and LABELS checks.
+ */
+#if OPT_UNSW && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+#if OPT_UNSW
+#define LARGESLABS
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -794,6 +811,13 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+static void mag_printstats(void);
+#endif
+#ifdef LARGESLABS
+static void large_printstats(void);
+#endif
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +836,14 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	mag_printstats();
+#endif
+#ifdef LARGESLABS
+	large_printstats();
+#endif
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -988,6 +1020,9 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+#if OPT_UNSW
+	frame_set_kmtag(prpage, blktype + 1);
+#endif
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1142,6 +1177,9 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_UNSW
+		frame_set_kmtag(prpage, 0);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1159,6 +1197,502 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+// Most subpage kmallocs and kfrees are served from a magazine: a
+// small stack of free blocks of one size, owned by one CPU. Each CPU
+// has a loaded magazine and the previous one for every size; when
+// both are empty (or full) it trades a magazine with the depot, which
+// keeps lists of full and empty magazines per size. Only when the
+// depot has no full magazine does kmalloc go to subpage_kmalloc, and
+// only when the depot is full does kfree go to subpage_kfree, so the
+// global kmalloc_spinlock is off the common path.
+//
+// Blocks in magazines count as allocated on their pages, so the
+// depot is bounded to keep them from pinning too much memory.
+//
+// kfree finds the size of a block from the tag subpage_kmalloc puts
+// on the page's frame (frame_set_kmtag), rather than by searching.
+//
+// Lock ordering: mc_lock before depot_lock. Neither is held across
+// subpage_kmalloc or subpage_kfree, which may call the VM.
+//
+
+#ifdef MAGAZINES
+
+#define MAG_ROUNDS 15		/* blocks per magazine */
+#define MAG_DEPOT_MAX 8		/* full magazines kept per size */
+
+struct magazine {
+	struct magazine *m_next;
+	unsigned m_rounds;
+	void *m_objs[MAG_ROUNDS];
+};
+
+struct mag_cpu {
+	struct spinlock mc_lock;
+	struct magazine *mc_loaded;
+	struct magazine *mc_prev;
+	unsigned mc_hits;	/* served without kmalloc_spinlock */
+	unsigned mc_misses;	/* went to the subpage allocator */
+};
+
+struct mag_depot {
+	struct magazine *md_full;
+	struct magazine *md_empty;
+	unsigned md_nfull;
+};
+
+static struct mag_cpu mag_cpus[MAXCPUS][NSIZES];
+static bool mag_cpus_ready;
+
+static struct spinlock depot_lock = SPINLOCK_INITIALIZER;
+static struct mag_depot depots[NSIZES];
+
+static struct kmem_cache magazine_cache =
+	KMEM_CACHE_INITIALIZER("magazine", sizeof(struct magazine),
+			       NULL, NULL);
+
+/*
+ * Return this CPU's magazines for BLKTYPE, locked, or NULL if there
+ * is no per-CPU state yet.
+ */
+static
+struct mag_cpu *
+mag_lock(unsigned blktype)
+{
+	struct mag_cpu *mc;
+	unsigned i, j;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	if (!mag_cpus_ready) {
+		/* first use, still single-threaded */
+		for (i=0; i<MAXCPUS; i++) {
+			for (j=0; j<NSIZES; j++) {
+				spinlock_init(&mag_cpus[i][j].mc_lock);
+			}
+		}
+		mag_cpus_ready = true;
+	}
+
+	mc = &mag_cpus[curcpu->c_number][blktype];
+	spinlock_acquire(&mc->mc_lock);
+	return mc;
+}
+
+/*
+ * Take a block of type BLKTYPE from this CPU's magazines, or NULL if
+ * neither they nor the depot have one.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct mag_cpu *mc;
+	struct mag_depot *md;
+	struct magazine *m;
+	void *ptr;
+
+	mc = mag_lock(blktype);
+	if (mc == NULL) {
+		return NULL;
+	}
+
+	if (mc->mc_loaded == NULL || mc->mc_loaded->m_rounds == 0) {
+		if (mc->mc_prev != NULL && mc->mc_prev->m_rounds > 0) {
+			m = mc->mc_prev;
+			mc->mc_prev = mc->mc_loaded;
+			mc->mc_loaded = m;
+		}
+		else {
+			/* hand back an empty magazine for a full one */
+			md = &depots[blktype];
+			spinlock_acquire(&depot_lock);
+			m = md->md_full;
+			if (m != NULL) {
+				md->md_full = m->m_next;
+				md->md_nfull--;
+				if (mc->mc_prev != NULL) {
+					mc->mc_prev->m_next = md->md_empty;
+					md->md_empty = mc->mc_prev;
+				}
+				mc->mc_prev = mc->mc_loaded;
+				mc->mc_loaded = m;
+			}
+			spinlock_release(&depot_lock);
+			if (m == NULL) {
+				mc->mc_misses++;
+				spinlock_release(&mc->mc_lock);
+				return NULL;
+			}
+		}
+	}
+
+	m = mc->mc_loaded;
+	ptr = m->m_objs[--m->m_rounds];
+	mc->mc_hits++;
+	spinlock_release(&mc->mc_lock);
+
+	return ptr;
+}
+
+/*
+ * Put PTR, a block of type BLKTYPE, in this CPU's magazines. Returns
+ * false if it has to go back to its page instead.
+ */
+static
+bool
+mag_free(void *ptr, unsigned blktype)
+{
+	struct mag_cpu *mc;
+	struct mag_depot *md;
+	struct magazine *m, *spare, *spill;
+	unsigned i;
+
+	md = &depots[blktype];
+	spare = NULL;
+	spill = NULL;
+
+	while (1) {
+		mc = mag_lock(blktype);
+		if (mc == NULL) {
+			KASSERT(spare == NULL);
+			return false;
+		}
+
+		if (mc->mc_loaded != NULL &&
+		    mc->mc_loaded->m_rounds < MAG_ROUNDS) {
+			break;
+		}
+		if (mc->mc_prev != NULL && mc->mc_prev->m_rounds == 0) {
+			m = mc->mc_prev;
+			mc->mc_prev = mc->mc_loaded;
+			mc->mc_loaded = m;
+			break;
+		}
+
+		/* hand back a full magazine for an empty one */
+		spinlock_acquire(&depot_lock);
+		m = spare;
+		spare = NULL;
+		if (m == NULL && md->md_empty != NULL) {
+			m = md->md_empty;
+			md->md_empty = m->m_next;
+		}
+		if (m != NULL) {
+			if (mc->mc_prev != NULL) {
+				if (md->md_nfull < MAG_DEPOT_MAX) {
+					mc->mc_prev->m_next = md->md_full;
+					md->md_full = mc->mc_prev;
+					md->md_nfull++;
+				}
+				else {
+					spill = mc->mc_prev;
+				}
+			}
+			mc->mc_prev = mc->mc_loaded;
+			mc->mc_loaded = m;
+		}
+		spinlock_release(&depot_lock);
+		if (m != NULL) {
+			break;
+		}
+
+		/* no empty magazine anywhere; make one unlocked */
+		spinlock_release(&mc->mc_lock);
+		spare = kmem_cache_alloc(&magazine_cache);
+		if (spare == NULL) {
+			return false;
+		}
+		spare->m_rounds = 0;
+	}
+
+	m = mc->mc_loaded;
+	m->m_objs[m->m_rounds++] = ptr;
+	mc->mc_hits++;
+	spinlock_release(&mc->mc_lock);
+
+	if (spare != NULL) {
+		/* not needed after all (we moved CPUs, or raced) */
+		spinlock_acquire(&depot_lock);
+		spare->m_next = md->md_empty;
+		md->md_empty = spare;
+		spinlock_release(&depot_lock);
+	}
+	if (spill != NULL) {
+		/* the depot is full; give the blocks back to their pages */
+		for (i=0; i<spill->m_rounds; i++) {
+			if (subpage_kfree(spill->m_objs[i])) {
+				panic("kfree: magazine held non-heap %p\n",
+				      spill->m_objs[i]);
+			}
+		}
+		kmem_cache_free(&magazine_cache, spill);
+	}
+
+	return true;
+}
+
+/*
+ * Print the per-CPU magazine counters.
+ */
+static
+void
+mag_printstats(void)
+{
+	unsigned i, j, hits, misses;
+
+	kprintf("Magazines (hits/misses by cpu):\n");
+	for (i=0; i<MAXCPUS; i++) {
+		hits = misses = 0;
+		for (j=0; j<NSIZES; j++) {
+			hits += mag_cpus[i][j].mc_hits;
+			misses += mag_cpus[i][j].mc_misses;
+		}
+		if (hits + misses > 0) {
+			kprintf("   cpu%u: %u/%u\n", i, hits, misses);
+		}
+	}
+}
+
+#endif /* MAGAZINES */
+
+
+#ifdef LARGESLABS
+
+////////////////////////////////////////////////////////////
+//
+// Multi-page slabs for mid-sized blocks.
+//
+// alloc_kpages hands out power-of-two runs of pages, so a 2100-byte
+// kmalloc used to take a whole page and a 9000-byte one four. Blocks
+// of a few classes between the subpage sizes and a handful of pages
+// are instead carved from multi-page slabs, LARGE_SLAB_OBJS to a
+// slab. Each block starts with a header recording its slab and
+// requested size, so kfree is O(1); the pages of a slab are tagged
+// LARGE_TAG (see frame_set_kmtag) so kfree can tell them apart.
+//
+// A class is used only when it beats the page allocator for the
+// size asked for; otherwise kmalloc still goes to alloc_kpages.
+//
+
+#define NLARGESIZES 4
+static const size_t large_sizes[NLARGESIZES] = { 3072, 6144, 12288, 24576 };
+static const unsigned large_slabpages[NLARGESIZES] = { 4, 8, 16, 32 };
+
+#define LARGE_SLAB_OBJS 5
+#define LARGE_TAG (NSIZES + 1)
+
+/* at the start of every block, allocated or free */
+struct largehdr {
+	struct largeslab *lh_slab;
+	size_t lh_size;		/* requested size; 0 while free */
+};
+
+/* at the start of every slab, followed by the blocks */
+struct largeslab {
+	struct largeslab *ls_next;	/* slabs of this size with free blocks */
+	struct largeslab *ls_prev;
+	struct largehdr *ls_freelist;	/* linked through lh_slab while free */
+	unsigned ls_type;
+	unsigned ls_nfree;
+};
+
+#define LARGE_OFFSET ROUNDUP(sizeof(struct largeslab), 8)
+
+static struct spinlock large_lock = SPINLOCK_INITIALIZER;
+static struct largeslab *large_bases[NLARGESIZES];
+static unsigned large_nslabs[NLARGESIZES];
+static unsigned large_inuse[NLARGESIZES];
+
+/*
+ * Pick the class for a block of SZ bytes, or -1 if whole pages waste
+ * no more.
+ */
+static
+int
+largetype(size_t sz)
+{
+	size_t pagebytes;
+	unsigned i;
+
+	for (pagebytes = PAGE_SIZE; pagebytes < sz; pagebytes *= 2) {
+		/* nothing */
+	}
+
+	for (i=0; i<NLARGESIZES; i++) {
+		if (sz + sizeof(struct largehdr) <= large_sizes[i]) {
+			return large_sizes[i] < pagebytes ? (int)i : -1;
+		}
+	}
+	return -1;
+}
+
+static
+void
+large_unlink(struct largeslab *ls)
+{
+	if (ls->ls_prev != NULL) {
+		ls->ls_prev->ls_next = ls->ls_next;
+	}
+	else {
+		KASSERT(large_bases[ls->ls_type] == ls);
+		large_bases[ls->ls_type] = ls->ls_next;
+	}
+	if (ls->ls_next != NULL) {
+		ls->ls_next->ls_prev = ls->ls_prev;
+	}
+}
+
+static
+void
+large_link(struct largeslab *ls)
+{
+	ls->ls_prev = NULL;
+	ls->ls_next = large_bases[ls->ls_type];
+	if (ls->ls_next != NULL) {
+		ls->ls_next->ls_prev = ls;
+	}
+	large_bases[ls->ls_type] = ls;
+}
+
+/*
+ * Allocate SZ bytes from the slabs of class LTYPE.
+ */
+static
+void *
+large_kmalloc(size_t sz, unsigned ltype)
+{
+	struct largeslab *ls;
+	struct largehdr *lh;
+	vaddr_t slab;
+	unsigned i;
+
+	spinlock_acquire(&large_lock);
+	ls = large_bases[ltype];
+	if (ls == NULL) {
+		/* make a new slab, without the lock (see subpage_kmalloc) */
+		spinlock_release(&large_lock);
+		slab = alloc_kpages(large_slabpages[ltype]);
+		if (slab == 0) {
+			return NULL;
+		}
+		for (i=0; i<large_slabpages[ltype]; i++) {
+			frame_set_kmtag(slab + i*PAGE_SIZE, LARGE_TAG);
+		}
+
+		ls = (struct largeslab *)slab;
+		ls->ls_type = ltype;
+		ls->ls_nfree = LARGE_SLAB_OBJS;
+		ls->ls_freelist = NULL;
+		for (i=LARGE_SLAB_OBJS; i-- > 0; ) {
+			lh = (struct largehdr *)
+				(slab + LARGE_OFFSET + i*large_sizes[ltype]);
+			lh->lh_slab = (struct largeslab *)ls->ls_freelist;
+			lh->lh_size = 0;
+			ls->ls_freelist = lh;
+		}
+		KASSERT(LARGE_OFFSET + LARGE_SLAB_OBJS*large_sizes[ltype]
+			<= large_slabpages[ltype]*PAGE_SIZE);
+
+		spinlock_acquire(&large_lock);
+		large_link(ls);
+		large_nslabs[ltype]++;
+	}
+
+	KASSERT(ls->ls_nfree > 0);
+	lh = ls->ls_freelist;
+	ls->ls_freelist = (struct largehdr *)lh->lh_slab;
+	ls->ls_nfree--;
+	if (ls->ls_nfree == 0) {
+		large_unlink(ls);
+	}
+	large_inuse[ltype]++;
+	spinlock_release(&large_lock);
+
+	lh->lh_slab = ls;
+	lh->lh_size = sz;
+	return lh + 1;
+}
+
+/*
+ * Free a block from large_kmalloc.
+ */
+static
+void
+large_kfree(void *ptr)
+{
+	struct largehdr *lh;
+	struct largeslab *ls;
+	unsigned ltype, i;
+	vaddr_t offset;
+
+	lh = (struct largehdr *)ptr - 1;
+	ls = lh->lh_slab;
+	if (((vaddr_t)ls & PAGE_FRAME) != (vaddr_t)ls || lh->lh_size == 0) {
+		panic("kfree: invalid or freed block %p\n", ptr);
+	}
+	ltype = ls->ls_type;
+	KASSERT(ltype < NLARGESIZES);
+	offset = (vaddr_t)lh - (vaddr_t)ls - LARGE_OFFSET;
+	if (offset % large_sizes[ltype] != 0 ||
+	    offset / large_sizes[ltype] >= LARGE_SLAB_OBJS) {
+		panic("kfree: invalid block %p\n", ptr);
+	}
+
+	fill_deadbeef(ptr, large_sizes[ltype] - sizeof(*lh));
+	lh->lh_size = 0;
+
+	spinlock_acquire(&large_lock);
+	lh->lh_slab = (struct largeslab *)ls->ls_freelist;
+	ls->ls_freelist = lh;
+	ls->ls_nfree++;
+	large_inuse[ltype]--;
+	if (ls->ls_nfree == 1) {
+		large_link(ls);
+	}
+	else if (ls->ls_nfree == LARGE_SLAB_OBJS &&
+		 (ls->ls_prev != NULL || ls->ls_next != NULL)) {
+		/* wholly free and not the last slab of its size */
+		large_unlink(ls);
+		large_nslabs[ltype]--;
+		spinlock_release(&large_lock);
+
+		for (i=0; i<large_slabpages[ltype]; i++) {
+			frame_set_kmtag((vaddr_t)ls + i*PAGE_SIZE, 0);
+		}
+		free_kpages((vaddr_t)ls);
+		return;
+	}
+	spinlock_release(&large_lock);
+}
+
+/*
+ * Print the multi-page slab counts.
+ */
+static
+void
+large_printstats(void)
+{
+	unsigned i;
+
+	kprintf("Multi-page slabs:\n");
+	spinlock_acquire(&large_lock);
+	for (i=0; i<NLARGESIZES; i++) {
+		kprintf("   size %-5lu  %u slabs, %u/%u blocks in use\n",
+			(unsigned long)large_sizes[i], large_nslabs[i],
+			large_inuse[i], large_nslabs[i] * LARGE_SLAB_OBJS);
+	}
+	spinlock_release(&large_lock);
+}
+
+#endif /* LARGESLABS */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1186,6 +1720,18 @@ kmalloc(size_t sz)
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
+#ifdef LARGESLABS
+		int ltype;
+		void *ptr;
+
+		ltype = largetype(sz);
+		if (ltype >= 0) {
+			ptr = large_kmalloc(sz, ltype);
+			if (ptr != NULL) {
+				return ptr;
+			}
+		}
+#endif
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
@@ -1201,6 +1747,16 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
 	return subpage_kmalloc(sz);
 #endif
 }
@@ -1211,12 +1767,39 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+#if OPT_UNSW
+	unsigned tag;
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_UNSW
+	tag = frame_kmtag((vaddr_t)ptr);
+#endif
+#ifdef LARGESLABS
+	if (tag == LARGE_TAG) {
+		large_kfree(ptr);
+		return;
+	}
+#endif
+#ifdef MAGAZINES
+	/* otherwise a tagged page is a subpage one of that size */
+	if (tag != 0) {
+		KASSERT(tag <= NSIZES);
+		if ((vaddr_t)ptr % sizes[tag - 1] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		fill_deadbeef(ptr, sizes[tag - 1]);
+		if (mag_free(ptr, tag - 1)) {
+			return;
+		}
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches; see kmemcache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+/*
+ * A slab is one page: this header, the free list, then the objects.
+ * ks_freelist[i] is the index of the free object after free object i,
+ * with ks_free the first; KS_NONE ends the list.
+ */
+struct kmem_slab {
+	struct kmem_slab *ks_next;
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;
+	unsigned ks_inuse;
+	unsigned ks_free;
+	uint16_t ks_freelist[];
+};
+
+#define KS_NONE 0xffff
+
+#define SLAB_OBJ(kc, s, i) \
+	((void *)((vaddr_t)(s) + (kc)->kc_offset + (i) * (kc)->kc_size))
+
+/* every cache that has been used, for kmem_cache_printstats */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+static
+void
+slab_link(struct kmem_slab **list, struct kmem_slab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = s;
+	}
+	*list = s;
+}
+
+static
+void
+slab_unlink(struct kmem_slab **list, struct kmem_slab *s)
+{
+	if (s->ks_prev != NULL) {
+		s->ks_prev->ks_next = s->ks_next;
+	} else {
+		*list = s->ks_next;
+	}
+	if (s->ks_next != NULL) {
+		s->ks_next->ks_prev = s->ks_prev;
+	}
+}
+
+/*
+ * Work out how many objects fit in a slab, and enter the cache on the
+ * list of caches. Called with kc_lock held, on first use.
+ */
+static
+void
+kmem_cache_layout(struct kmem_cache *kc)
+{
+	unsigned n, offset;
+
+	kc->kc_size = (kc->kc_size + 7) & ~(size_t)7;
+	KASSERT(kc->kc_size > 0 && kc->kc_size <= PAGE_SIZE / 2);
+
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_size + sizeof(uint16_t));
+	while (1) {
+		offset = (sizeof(struct kmem_slab) + n * sizeof(uint16_t) + 7)
+			& ~7U;
+		if (offset + n * kc->kc_size <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	KASSERT(n > 0 && n < KS_NONE);
+	kc->kc_perslab = n;
+	kc->kc_offset = offset;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+}
+
+/*
+ * Destructor calls and page release for a slab whose first N objects
+ * were constructed.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *s, unsigned n)
+{
+	unsigned i;
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(SLAB_OBJ(kc, s, i));
+		}
+	}
+	free_kpages((vaddr_t)s);
+}
+
+/*
+ * Make a new slab with every object constructed and free. Called
+ * without kc_lock, as constructors may allocate memory themselves.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *s;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	s = (struct kmem_slab *)page;
+	s->ks_cache = kc;
+	s->ks_inuse = 0;
+	s->ks_free = 0;
+	for (i=0; i<kc->kc_perslab; i++) {
+		s->ks_freelist[i] = i + 1 < kc->kc_perslab ? i + 1 : KS_NONE;
+		if (kc->kc_ctor != NULL && kc->kc_ctor(SLAB_OBJ(kc, s, i))) {
+			kmem_slab_destroy(kc, s, i);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_perslab = 0;
+	kc->kc_offset = 0;
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_emptyslabs = 0;
+	kc->kc_next = NULL;
+	kc->kc_allocs = 0;
+	kc->kc_frees = 0;
+	kc->kc_inuse = 0;
+	kc->kc_slabs = 0;
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *s;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_full == NULL);
+
+	while ((s = kc->kc_partial) != NULL) {
+		slab_unlink(&kc->kc_partial, s);
+		kmem_slab_destroy(kc, s, kc->kc_perslab);
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != NULL; kcp = &(*kcp)->kc_next) {
+		if (*kcp == kc) {
+			*kcp = kc->kc_next;
+			break;
+		}
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *s;
+	unsigned i;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_perslab == 0) {
+		kmem_cache_layout(kc);
+	}
+	while (kc->kc_partial == NULL) {
+		spinlock_release(&kc->kc_lock);
+		s = kmem_slab_create(kc);
+		if (s == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_link(&kc->kc_partial, s);
+		kc->kc_slabs++;
+		kc->kc_emptyslabs++;
+	}
+
+	s = kc->kc_partial;
+	i = s->ks_free;
+	KASSERT(i != KS_NONE);
+	s->ks_free = s->ks_freelist[i];
+	if (s->ks_inuse++ == 0) {
+		kc->kc_emptyslabs--;
+	}
+	if (s->ks_free == KS_NONE) {
+		slab_unlink(&kc->kc_partial, s);
+		slab_link(&kc->kc_full, s);
+	}
+	kc->kc_allocs++;
+	kc->kc_inuse++;
+	spinlock_release(&kc->kc_lock);
+
+	return SLAB_OBJ(kc, s, i);
+}
+
+/*
+ * Keep one all-free slab around so that a cache whose use hovers near
+ * a slab boundary does not allocate and construct a page every time;
+ * give back any others.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *s;
+	unsigned i;
+
+	s = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(s->ks_cache == kc);
+	i = ((vaddr_t)obj - (vaddr_t)s - kc->kc_offset) / kc->kc_size;
+	KASSERT(i < kc->kc_perslab && SLAB_OBJ(kc, s, i) == obj);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(s->ks_inuse > 0);
+	if (s->ks_free == KS_NONE) {
+		slab_unlink(&kc->kc_full, s);
+		slab_link(&kc->kc_partial, s);
+	}
+	s->ks_freelist[i] = s->ks_free;
+	s->ks_free = i;
+	kc->kc_frees++;
+	kc->kc_inuse--;
+	if (--s->ks_inuse == 0) {
+		if (kc->kc_emptyslabs > 0) {
+			slab_unlink(&kc->kc_partial, s);
+			kc->kc_slabs--;
+			spinlock_release(&kc->kc_lock);
+			kmem_slab_destroy(kc, s, kc->kc_perslab);
+			return;
+		}
+		kc->kc_emptyslabs++;
+	}
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Print the counters of each cache. They are read without the cache
+ * locks, so they may be a little inconsistent with each other.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("  %-12s %4lu bytes: %u in use, %u slabs of %u, "
+			"%u allocs, %u frees\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_inuse, kc->kc_slabs, kc->kc_perslab,
+			kc->kc_allocs, kc->kc_frees);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
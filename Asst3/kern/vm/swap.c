@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space: page-out of user frames to a raw disk.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <current.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;	/* raw swap device, NULL if none */
+static struct bitmap *swap_map;		/* one bit per PAGE_SIZE slot */
+static struct spinlock swap_map_lock = SPINLOCK_INITIALIZER;
+static struct lock *swap_lock;		/* serialises swap_evict */
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	swap_lock = lock_create("swap");
+	if (swap_lock == NULL) {
+		panic("swap: Could not create swap lock\n");
+	}
+
+	result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s, paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat of %s failed: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(nslots);
+	if (swap_map == NULL) {
+		panic("swap: Could not create slot bitmap\n");
+	}
+	kprintf("swap: %u pages of swap on %s\n", nslots, SWAP_DEVICE);
+}
+
+void
+swap_lock_acquire(void)
+{
+	lock_acquire(swap_lock);
+}
+
+void
+swap_lock_release(void)
+{
+	lock_release(swap_lock);
+}
+
+static
+int
+swap_slot_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+	spinlock_acquire(&swap_map_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_map_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_map_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_map_lock);
+}
+
+/*
+ * Move one page between the kernel address KVADDR and SLOT.
+ */
+static
+int
+swap_io(unsigned slot, vaddr_t kvaddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	uio_kinit(&iov, &u, (void *)kvaddr, PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, PADDR_TO_KVADDR(paddr), UIO_READ);
+	if (result) {
+		return result;
+	}
+	swap_free(slot);
+	return 0;
+}
+
+/*
+ * Read SLOT into the page at KVADDR without giving the slot up.
+ */
+int
+swap_read(unsigned slot, vaddr_t kvaddr)
+{
+	return swap_io(slot, kvaddr, UIO_READ);
+}
+
+int
+swap_dup(unsigned slot, unsigned *ret)
+{
+	void *buf;
+	int result;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	result = swap_slot_alloc(ret);
+	if (result) {
+		kfree(buf);
+		return ENOMEM;
+	}
+	result = swap_io(slot, (vaddr_t)buf, UIO_READ);
+	if (result == 0) {
+		result = swap_io(*ret, (vaddr_t)buf, UIO_WRITE);
+	}
+	if (result) {
+		swap_free(*ret);
+	}
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Page out one user frame, chosen by the second-chance clock.
+ *
+ * Candidates come from the frame table's reverse map. Their owner is
+ * kept alive by swap_lock (see as_destroy), but the mapping may have
+ * changed since the frame table was scanned, so it is checked again
+ * under the owner's pt_lock before anything is done.
+ *
+ * A referenced candidate survives: its entry loses TLBLO_VALID and
+ * its TLB entry is dropped, so the next access faults into vm_fault,
+ * which sets the reference bit again. Two sweeps of the clock are
+ * therefore enough to find a victim if there is one.
+ *
+ * A text cache page is clean and is simply dropped; vm_fault reads it
+ * from the file again. Any other victim is written to swap with no
+ * locks held, so that faults in the owner and other page-outs need
+ * not wait for the disk. The frame is unmapped and referenced first.
+ * Afterwards, if the owner still has it and the entry has not changed,
+ * the entry is pointed at the slot; otherwise the page was touched,
+ * unmapped or shared meanwhile, and the copy on swap is thrown away.
+ */
+int
+swap_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr, old;
+	paddr_t *pte;
+	unsigned slot, tries, limit;
+	bool referenced, done;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(swap_lock);
+	limit = 2 * frame_count();
+	for (tries = 0; tries < limit; tries++) {
+		paddr = frame_clock_next(&as, &vaddr, &referenced);
+		if (paddr == 0) {
+			break;
+		}
+
+		lock_acquire(as->pt_lock);
+		KASSERT(as->pagetable[get_first_10_bits(vaddr)] != NULL);
+		pte = &as->pagetable[get_first_10_bits(vaddr)]
+			[get_middle_10_bits(vaddr)];
+		if ((*pte & PTE_SWAPPED) || (*pte & PAGE_FRAME) != paddr ||
+		    frame_refcount(paddr) != 1) {
+			/* stale reverse mapping; try another frame */
+			lock_release(as->pt_lock);
+			continue;
+		}
+
+		if (referenced) {
+			/* second chance */
+			*pte &= ~TLBLO_VALID;
+			/*
+			 * Only this CPU's entry; another CPU may miss a
+			 * use, but the page-out below shoots them all.
+			 */
+			vm_tlbinvalidate(as, vaddr);
+			lock_release(as->pt_lock);
+			continue;
+		}
+
+		if (frame_is_text(paddr)) {
+			*pte = EMPTY;
+			as->pt_count[get_first_10_bits(vaddr)]--;
+			vm_tlbshoot(as, vaddr, vaddr + PAGE_SIZE);
+			lock_release(as->pt_lock);
+			frame_free(paddr, as);
+			VMSTAT_INC(vs_textdrops);
+			lock_release(swap_lock);
+			return 0;
+		}
+
+		result = swap_slot_alloc(&slot);
+		if (result) {
+			lock_release(as->pt_lock);
+			break;
+		}
+
+		/*
+		 * Unmap first so the page cannot change under the
+		 * write. Clearing TLBLO_VALID before the shootdown
+		 * keeps the UTLB refill and vm_fault's lockless path
+		 * from loading the entry again; a fault on it goes to
+		 * the locked path and changes the entry. Our reference
+		 * keeps the frame in memory whatever happens.
+		 */
+		*pte &= ~TLBLO_VALID;
+		old = *pte;
+		vm_tlbshoot(as, vaddr, vaddr + PAGE_SIZE);
+		frame_ref(paddr);
+		lock_release(as->pt_lock);
+		lock_release(swap_lock);
+
+		result = swap_io(slot, PADDR_TO_KVADDR(paddr), UIO_WRITE);
+
+		lock_acquire(swap_lock);
+		done = false;
+		/* an owner that let go of the frame may be gone */
+		if (result == 0 && frame_owned_by(paddr, as)) {
+			lock_acquire(as->pt_lock);
+			if (*pte == old && frame_refcount(paddr) == 2) {
+				/* unreachable once the entry names the slot */
+				*pte = SLOT_TO_PTE(slot);
+				done = true;
+			}
+			lock_release(as->pt_lock);
+		}
+		if (!done) {
+			swap_free(slot);
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			if (result) {
+				lock_release(swap_lock);
+				return result;
+			}
+			continue;
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		frame_free(paddr, as);
+		VMSTAT_INC(vs_swapouts);
+		lock_release(swap_lock);
+		return 0;
+	}
+	lock_release(swap_lock);
+	return ENOMEM;
+}
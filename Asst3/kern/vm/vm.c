@@ -9,6 +9,11 @@
 #include <current.h>
 #include <machine/tlb.h>
 #include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <swap.h>
+#include <membar.h>
 /***************************************
  * Page Table Operation Functions
  ***************************************/
@@ -18,36 +23,43 @@
  * 3) Link the Page Table Lvl 1 has reference to lvl 2
  * 4) Lvl 2 has ref to frame number
  * Assumed that paddr is already allocated a frame.
+ * A new second-level table is filled in before it is published, so
+ * that look_up_pt and the UTLB refill can walk the table without
+ * pt_lock. Returns ENOMEM if there is no memory for a new table, or
+ * EEXIST if someone else mapped the page first.
  */
 int insert_pt(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
 {
     uint32_t pd_bits = get_first_10_bits(vaddr);
     uint32_t pt_bits = get_middle_10_bits(vaddr);
 
-    if (pd_bits >= PAGETABLE_SIZE || pt_bits >= PAGETABLE_SIZE) {
-        return EFAULT; //TODO: Make sure this is correct error
-    }
+    /* ten bits each, so always in range */
+    KASSERT(pd_bits < PAGETABLE_SIZE && pt_bits < PAGETABLE_SIZE);
 
     lock_acquire(as->pt_lock);
 
     if (as->pagetable[pd_bits] == NULL) {
-        as->pagetable[pd_bits] = kmalloc(PAGE_SIZE);
-        if (as->pagetable[pd_bits] == NULL) {
+        paddr_t *table = (paddr_t *) alloc_kpages(1);
+        if (table == NULL) {
             lock_release(as->pt_lock);
             return ENOMEM;
         }
         for(int i = 0; i < PAGETABLE_SIZE; i++) {
-            as->pagetable[pd_bits][i] = EMPTY;
+            table[i] = EMPTY;
         }
+        /* readers must never see the table before its entries */
+        membar_store_store();
+        as->pagetable[pd_bits] = table;
     } else {
         // Check if there is something in page already
         if (as->pagetable[pd_bits][pt_bits] != EMPTY ){
             lock_release(as->pt_lock);
-            return EFAULT; //TODO: Make sure this is correct error
+            return EEXIST;
         }
     }
 
     as->pagetable[pd_bits][pt_bits] = paddr;
+    as->pt_count[pd_bits]++;
     lock_release(as->pt_lock);
 
     return 0;
@@ -57,76 +69,51 @@ int insert_pt(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
 /* Look up Page Table entry
  * 1) Convert
  * 2) See if it is in a valid address space
- *      - FAILS return 0
- *      - SUCCESS return Frame No.
+ *      - FAILS return EMPTY
+ *      - SUCCESS return the entry
+ * This does not take pt_lock. Second-level tables are published only
+ * once filled in (see insert_pt) and are not freed before as_destroy,
+ * and an entry is one word, so we see either the old or the new value
+ * of any update. Callers that act on the entry must check it again:
+ * under pt_lock before changing it, or after loading it into the TLB.
  */
 paddr_t look_up_pt(struct addrspace *as, vaddr_t vaddr)
 {
-    KASSERT(0);
     uint32_t pd_bits = get_first_10_bits(vaddr);
     uint32_t pt_bits = get_middle_10_bits(vaddr);
 
-    if (probe_pt(as, vaddr) != 0) {
-        return EMPTY; //TODO: REPLACE with OUT OF RANGE
+    paddr_t *table = as->pagetable[pd_bits];
+    if (table == NULL) {
+        return EMPTY;
     }
-
-    pd_bits = get_first_10_bits(vaddr);
-    pt_bits = get_middle_10_bits(vaddr);
-
-    return as->pagetable[pd_bits][pt_bits];
+    /* pairs with the barrier in insert_pt */
+    membar_load_load();
+    return table[pt_bits];
 }
 /*
  * look for an entry matching the virtual page
  * Returns the 0, or a negative number if no matching entry
- * was found. 
+ * was found. Lock free, like look_up_pt.
  */
 int probe_pt(struct addrspace *as, vaddr_t vaddr) {
-    uint32_t pd_bits = get_first_10_bits(vaddr);
-    uint32_t pt_bits = get_middle_10_bits(vaddr);
-
-    if (pd_bits >= PAGETABLE_SIZE || pt_bits >= PAGETABLE_SIZE) {
-        return -1; //TODO: REPLACE with OUT OF RANGE
-    }
-    lock_acquire(as->pt_lock);
     if (as->pagetable == NULL) {
-        lock_release(as->pt_lock);
-        return -1;
-    }
-    if (as->pagetable[pd_bits] == NULL) {
-        lock_release(as->pt_lock);
         return -1;
     }
-
-    if (as->pagetable[pd_bits][pt_bits] == EMPTY) {
-        lock_release(as->pt_lock);
-        return -1;
-    }
-
-    lock_release(as->pt_lock);
-    
-    return 0;
+    return look_up_pt(as, vaddr) == EMPTY ? -1 : 0;
 }
 
-/* Update Page Table Entry
- * 1) Convert
- * 2) Look up Page Table entry
- *      - FAILS return -1
- * 3) Update table
+/*
+ * A frame of zeroes mapped read-only for reads of untouched anonymous
+ * memory. Each mapping holds a reference and the VM system holds one
+ * that it never drops, so the frame is always shared: a write goes
+ * through cow_fault for a private copy, and it is never paged out or
+ * freed.
  */
-int update_pt(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
-{
-    KASSERT(0);
-    uint32_t result = probe_pt(as, vaddr);
-    if (result) return result;
-
-    uint32_t pd_bits = get_first_10_bits(vaddr);
-    uint32_t pt_bits = get_middle_10_bits(vaddr);
-
-    as->pagetable[pd_bits][pt_bits] = paddr;
-
-    return 0;
-}
+static paddr_t zero_paddr;
 
+unsigned vm_fault_around = FAULT_AROUND_PAGES;
+size_t vm_stack_limit = USER_STACK_LIMIT;
+struct vmstat vm_cpustats[MAXCPUS];
 
 void vm_bootstrap(void)
 {
@@ -135,7 +122,16 @@ void vm_bootstrap(void)
        NOTE: Frame Table already INIT and is already been done, no need to worry anything about it
        https://piazza.com/class/jrr04q7mah621s?cid=491
        Basically can do nothing???
+       Swap is attached here, now that the disks have been probed.
     */
+    swap_bootstrap();
+
+    vaddr_t zero = alloc_kpages(1);
+    if (zero == 0) {
+        panic("vm: no memory for the zero page\n");
+    }
+    bzero((void *) zero, PAGE_SIZE);
+    zero_paddr = KVADDR_TO_PADDR(zero);
 }
 
 
@@ -144,23 +140,26 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
     /*
      * vm_fault is called when there is a page fault
      * Logic is define as following:
-     * 1) check if address space is read only
-     *      - YES: EFAULT
+     * 1) check if the fault is a write to a read only page
+     *      - YES: break copy-on-write sharing if the region is
+     *             writeable, otherwise EFAULT
      *      - NO: move to next step
      * 2) Look up Page Table, check if PTE exist for this address.
-     *      - YES: load to TLB and solve this fault (exit)
+     *      - YES: load to TLB and solve this fault (exit). Valid
+     *             entries are normally loaded by the UTLB refill in
+     *             exception-mips1.S and never get here.
      *      - NO: move to next step
      * 3) Look the address space's region. check if it is a valid region.
      *      - YES: move to next step
      *      - NO: EFAULT
-     * 4) Allocate Frame, Zero-filled, Insert PTE and then load TLB
+     * 4) Allocate Frame, fill it from the region's file (or zero-fill),
+     *    Insert PTE and then load TLB
      * Note: faultaddress is a virtual address, thus 10 bits = pd, 20 bits = pt
      */
 
     switch (faulttype)
     {
         case VM_FAULT_READONLY:
-            return EFAULT;
         case VM_FAULT_WRITE:
         case VM_FAULT_READ:
             break;
@@ -188,92 +187,552 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
     }
     paddr_t **pagetable = as->pagetable;
     if (pagetable == NULL) return EFAULT;
+
+    VMSTAT_INC(vs_faults);
+    if (faulttype == VM_FAULT_READONLY) {
+        VMSTAT_INC(vs_faults_readonly);
+        return cow_fault(as, faultaddress);
+    }
+    if (faulttype == VM_FAULT_READ) {
+        VMSTAT_INC(vs_faults_read);
+    } else {
+        VMSTAT_INC(vs_faults_write);
+    }
     uint32_t pd_bits = get_first_10_bits(faultaddress);
     uint32_t pt_bits = get_middle_10_bits(faultaddress);
 
 
 
-    /* Look up Page Table */
-    if (probe_pt(as, faultaddress) == 0)
+    /* Look up Page Table, without pt_lock (see look_up_pt) */
+    paddr_t pte = look_up_pt(as, faultaddress);
+    if (pte != EMPTY && (pte & PTE_SWAPPED) == 0)
     {
         /* get region and check bits */
-        if (lookup_region(as, faultaddress, faulttype) == 0) {
-            /* Load into TLB */
-            load_tlb(faultaddress & PAGE_FRAME, pagetable[pd_bits][pt_bits]);
+        int result = lookup_region(as, faultaddress, faulttype);
+        if (result) {
+            return EFAULT;
+        }
+        if (pte & TLBLO_VALID) {
+            /*
+             * Load into TLB, then check that the page was not paged
+             * out meanwhile. swap_evict changes the entry before it
+             * drops TLB entries, so if the entry is unchanged now,
+             * ours will be dropped along with the rest.
+             */
+            update_tlb(faultaddress & PAGE_FRAME, pte);
+            if (look_up_pt(as, faultaddress) != pte) {
+                vm_tlbinvalidate(as, faultaddress);
+                return 0; /* retry the access */
+            }
+            if (!frame_set_referenced(pte & PAGE_FRAME) &&
+                (pte & PAGE_FRAME) != zero_paddr) {
+                /* a sharer let go of it; adopt it for page-out */
+                lock_acquire(as->pt_lock);
+                if (pagetable[pd_bits][pt_bits] == pte) {
+                    frame_claim(pte & PAGE_FRAME, as, faultaddress);
+                }
+                lock_release(as->pt_lock);
+            }
+            VMSTAT_INC(vs_tlbreloads);
             return 0;
         }
-        return EFAULT;
+
+        /* the clock invalidated it to catch this access */
+        lock_acquire(as->pt_lock);
+        if (pagetable[pd_bits][pt_bits] == pte) {
+            pte |= TLBLO_VALID;
+            pagetable[pd_bits][pt_bits] = pte;
+            if (!frame_set_referenced(pte & PAGE_FRAME) &&
+                (pte & PAGE_FRAME) != zero_paddr) {
+                frame_claim(pte & PAGE_FRAME, as, faultaddress);
+            }
+            update_tlb(faultaddress & PAGE_FRAME, pte);
+            VMSTAT_INC(vs_tlbreloads);
+        }
+        lock_release(as->pt_lock);
+        return 0;
     }
 
 
     /* Check for valid Region
      * This means that we have to check whether its accessing a page that
-     * should exist but have not been accessed yet
+     * should exist but have not been accessed yet. Outside every region
+     * the stack may grow down to cover the address.
      */
+    if (pte == EMPTY && get_region(as, faultaddress) == NULL) {
+        as_grow_stack(as, faultaddress);
+    }
     int result = lookup_region(as, faultaddress, faulttype); 
     if(result) {
         return result;
     }
 
     /* Found a region that is within process's region*/
-    vaddr_t newVaddr = alloc_frame(as, faultaddress);
-    if (newVaddr == 0) return ENOMEM;
-    paddr_t paddr = KVADDR_TO_PADDR(newVaddr) & PAGE_FRAME;
     struct region *region = get_region(as, faultaddress);
-    /* insert into PTE */
-    if (region->writeable != 0) {
+    if (pte != EMPTY) {
+        /* paged out, bring it back in */
+        return page_in(as, region, faultaddress, pte);
+    }
+
+    uint32_t textoff;
+    bool text = region_text_offset(region, faultaddress, &textoff);
+    paddr_t paddr = 0;
+    vaddr_t newVaddr;
+    if (faulttype == VM_FAULT_READ && zero_paddr != 0 &&
+        region_zero_page(region, faultaddress)) {
+        /* nothing has been written here yet, share the zero page */
+        frame_ref(zero_paddr);
+        paddr = zero_paddr;
+        VMSTAT_INC(vs_zeromaps);
+    } else if (text) {
+        /* read-only text may already be in memory for another process */
+        paddr = frame_text_lookup(region->vnode, textoff);
+        if (paddr != 0) {
+            VMSTAT_INC(vs_textshares);
+        }
+    }
+    if (paddr != 0) {
+        newVaddr = PADDR_TO_KVADDR(paddr);
+    } else if (region_zero_page(region, faultaddress)) {
+        newVaddr = alloc_zeroed_frame(as, faultaddress);
+        if (newVaddr == 0) return ENOMEM;
+        paddr = KVADDR_TO_PADDR(newVaddr) & PAGE_FRAME;
+        VMSTAT_INC(vs_zerofills);
+    } else {
+        newVaddr = alloc_frame(as, faultaddress);
+        if (newVaddr == 0) return ENOMEM;
+        /* read the page in from the executable */
+        result = region_fill(region, faultaddress, newVaddr);
+        if (result) {
+            free_kpages(newVaddr);
+            return result;
+        }
+        paddr = KVADDR_TO_PADDR(newVaddr) & PAGE_FRAME;
+        VMSTAT_INC(vs_filereads);
+        if (text) {
+            frame_text_insert(paddr, region->vnode, textoff);
+        }
+    }
+    bool shared = frame_refcount(paddr) > 1;
+    /* insert into PTE; mapped pages stay clean until written */
+    if (!shared && region->writeable != 0 &&
+        (region->mapped == 0 || faulttype == VM_FAULT_WRITE)) {
         paddr = paddr | TLBLO_DIRTY;
     }
 
     result = insert_pt(as, faultaddress, paddr | TLBLO_VALID);
+    if (result == ENOMEM && swap_evict() == 0) {
+        /* no memory for the page table itself; page out and retry */
+        result = insert_pt(as, faultaddress, paddr | TLBLO_VALID);
+    }
+    if (result == EEXIST) {
+        /* another thread mapped it first; retry the access */
+        free_kpages(newVaddr);
+        return 0;
+    }
     if (result != 0) {
+        free_kpages(newVaddr);
         return ENOMEM;
     }
-    /* Load TLB*/
-    load_tlb(faultaddress & PAGE_FRAME, pagetable[pd_bits][pt_bits]);
+    /* Load TLB, then let the frame be paged out unless it is shared */
+    load_tlb(faultaddress & PAGE_FRAME, paddr | TLBLO_VALID);
+    if (!shared) {
+        frame_set_owner(paddr & PAGE_FRAME, as, faultaddress);
+    }
+    fault_around(as, region, faultaddress, faulttype);
     return 0;         /* return sucessfully */
 
 }
 
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * Map the untouched neighbours of VADDR in the aligned window of
+ * vm_fault_around pages, as long as that costs no I/O and no paging:
+ *      - text pages another process already has in memory
+ *      - zero-fill pages: the zero page after a read, else a frame
+ *        from the pre-zeroed pool while it lasts
+ * Pages that need reading from a file are left for their own fault.
+ * Only the page table is filled in; the UTLB refill loads the entries
+ * without a trap when they are first touched.
+ */
+void fault_around(struct addrspace *as, struct region *region, vaddr_t vaddr, int faulttype)
+{
+    if (vm_fault_around <= 1) {
+        return;
+    }
+
+    vaddr_t window = vm_fault_around * PAGE_SIZE;
+    vaddr_t start = vaddr & ~(window - 1);
+    vaddr_t end = start + window;
+    vaddr_t region_end = region->base_addr + region->memsize;
+    if (start < (region->base_addr & PAGE_FRAME)) {
+        start = region->base_addr & PAGE_FRAME;
+    }
+    if (end > region_end || end < start) {
+        end = region_end;
+    }
+
+    for (vaddr_t page = start; page < end; page += PAGE_SIZE) {
+        if (page == (vaddr & PAGE_FRAME) || look_up_pt(as, page) != EMPTY) {
+            continue;
+        }
+
+        uint32_t textoff;
+        vaddr_t kvaddr;
+        paddr_t paddr = 0;
+        if (region_text_offset(region, page, &textoff)) {
+            paddr = frame_text_lookup(region->vnode, textoff);
+        } else if (region_zero_page(region, page)) {
+            if (faulttype == VM_FAULT_READ) {
+                frame_ref(zero_paddr);
+                paddr = zero_paddr;
+            } else if ((kvaddr = frame_zero_get()) != 0) {
+                paddr = KVADDR_TO_PADDR(kvaddr) & PAGE_FRAME;
+            }
+        }
+        if (paddr == 0) {
+            continue;
+        }
+
+        bool shared = frame_refcount(paddr) > 1;
+        paddr_t pte = paddr | TLBLO_VALID;
+        if (!shared && region->writeable != 0 && region->mapped == 0) {
+            pte |= TLBLO_DIRTY;
+        }
+        if (insert_pt(as, page, pte) != 0) {
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            continue;
+        }
+        if (!shared) {
+            frame_set_owner(paddr, as, page);
+        }
+        VMSTAT_INC(vs_faultaround);
+    }
+}
+
+/*
+ * Bring a paged out page back in.
+ * PTE is the swapped entry seen by vm_fault; if it has changed by the
+ * time we hold pt_lock again someone else dealt with the page and the
+ * access is simply retried.
+ */
+int page_in(struct addrspace *as, struct region *region, vaddr_t vaddr, paddr_t pte)
+{
+    uint32_t pd_bits = get_first_10_bits(vaddr);
+    uint32_t pt_bits = get_middle_10_bits(vaddr);
+
+    vaddr_t newVaddr = alloc_frame(as, vaddr);
+    if (newVaddr == 0) return ENOMEM;
+    paddr_t paddr = KVADDR_TO_PADDR(newVaddr);
+
+    lock_acquire(as->pt_lock);
+    if (as->pagetable[pd_bits][pt_bits] != pte) {
+        lock_release(as->pt_lock);
+        free_kpages(newVaddr);
+        return 0;
+    }
+    int result = swap_in(PTE_TO_SLOT(pte), paddr);
+    if (result) {
+        lock_release(as->pt_lock);
+        free_kpages(newVaddr);
+        return result;
+    }
+    VMSTAT_INC(vs_swapins);
+    paddr |= TLBLO_VALID;
+    if (region->writeable != 0) {
+        paddr |= TLBLO_DIRTY;
+    }
+    as->pagetable[pd_bits][pt_bits] = paddr;
+    load_tlb(vaddr & PAGE_FRAME, paddr);
+    lock_release(as->pt_lock);
+
+    frame_set_owner(paddr & PAGE_FRAME, as, vaddr);
+    return 0;
+}
+
+/*
+ * Handle a write to a page mapped without TLBLO_DIRTY.
+ * If the region is writeable the page is shared copy-on-write:
+ *      - frame still shared: copy it into a private frame
+ *      - last mapping left: just make it writeable again
+ * Either way the stale read-only TLB entry is replaced.
+ */
+int cow_fault(struct addrspace *as, vaddr_t vaddr)
+{
+    uint32_t pd_bits = get_first_10_bits(vaddr);
+    uint32_t pt_bits = get_middle_10_bits(vaddr);
+
+    struct region *region = get_region(as, vaddr);
+    if (region == NULL || region->writeable == 0) {
+        return EFAULT;
+    }
+
+    lock_acquire(as->pt_lock);
+    if (as->pagetable[pd_bits] == NULL ||
+        as->pagetable[pd_bits][pt_bits] == EMPTY) {
+        lock_release(as->pt_lock);
+        return EFAULT;
+    }
+
+    paddr_t pte = as->pagetable[pd_bits][pt_bits];
+    if (pte & PTE_SWAPPED) {
+        /* paged out meanwhile; the retried access pages it in */
+        lock_release(as->pt_lock);
+        return 0;
+    }
+
+    paddr_t paddr = pte & PAGE_FRAME;
+    if (frame_refcount(paddr) > 1) {
+        /* alloc_frame may page out, so it must not hold pt_lock */
+        lock_release(as->pt_lock);
+        vaddr_t newVaddr;
+        if (paddr == zero_paddr) {
+            newVaddr = alloc_zeroed_frame(as, vaddr);
+        } else {
+            newVaddr = alloc_frame(as, vaddr);
+        }
+        if (newVaddr == 0) {
+            return ENOMEM;
+        }
+        lock_acquire(as->pt_lock);
+        if (as->pagetable[pd_bits][pt_bits] != pte) {
+            lock_release(as->pt_lock);
+            free_kpages(newVaddr);
+            return 0;
+        }
+        if (paddr != zero_paddr) {
+            memmove((void *) newVaddr, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+        }
+        as->pagetable[pd_bits][pt_bits] = KVADDR_TO_PADDR(newVaddr) | TLBLO_DIRTY | TLBLO_VALID;
+        /* other CPUs may still read the old frame; then drop our share */
+        vm_tlbshoot(as, vaddr, vaddr + PAGE_SIZE);
+        /* drops the old frame's owner too, if it was us */
+        frame_free(paddr, as);
+        paddr = KVADDR_TO_PADDR(newVaddr);
+        VMSTAT_INC(vs_cowcopies);
+    } else {
+        VMSTAT_INC(vs_cowreuses);
+    }
+
+    as->pagetable[pd_bits][pt_bits] = paddr | TLBLO_DIRTY | TLBLO_VALID;
+
+    /* Replace the read-only TLB entry */
+    update_tlb(vaddr & PAGE_FRAME, paddr | TLBLO_DIRTY | TLBLO_VALID);
+    lock_release(as->pt_lock);
+
+    frame_set_owner(paddr, as, vaddr);
+    return 0;
+}
+
+/***************************************
+ * Address Space IDs
+ ***************************************/
+/*
+ * Each address space is given a hardware ASID the first time it runs,
+ * and its TLB entries are tagged with it, so a context switch no
+ * longer has to flush the TLB. IDs are handed out in order and never
+ * reused within a generation; when they run out a new generation
+ * starts, every CPU flushes its TLB before it next activates an
+ * address space, and address spaces holding an ID from an old
+ * generation get a new one when they next run. ASID 0 is never handed
+ * out, so the invalid entries written by vm_tlbflush cannot match.
  */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;  /* as_asid_gen 0 means no ASID yet */
+static uint32_t asid_next = 1;
+static bool asid_flush[MAXCPUS];      /* flush before the next activate */
+static uint32_t cpu_asid[MAXCPUS];    /* ASID in use on each CPU */
+
+/* page table of the address space running on each CPU, for the UTLB refill */
+paddr_t **cpu_pagetable[MAXCPUS];
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+void vm_asid_activate(struct addrspace *as)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    unsigned cpu;
+    bool flush;
+
+    int spl = splhigh();
+    cpu = curcpu->c_number;
+
+    spinlock_acquire(&asid_lock);
+    if (as->as_asid_gen != asid_generation) {
+        if (asid_next == NUM_ASID) {
+            /* out of IDs, start again once every TLB is clean */
+            asid_generation++;
+            asid_next = 1;
+            for (unsigned i = 0; i < MAXCPUS; i++) {
+                asid_flush[i] = true;
+            }
+        }
+        as->as_asid = asid_next++;
+        as->as_asid_gen = asid_generation;
+    }
+    flush = asid_flush[cpu];
+    asid_flush[cpu] = false;
+    cpu_asid[cpu] = as->as_asid;
+    cpu_pagetable[cpu] = as->pagetable;
+    as->as_cpus |= (uint32_t)1 << cpu;
+    spinlock_release(&asid_lock);
+
+    if (flush) {
+        vm_tlbflush();
+    }
+    tlb_setasid(cpu_asid[cpu]);
+    splx(spl);
+}
+
+/* Stop the UTLB refill on any CPU from walking AS's page table */
+void vm_asid_release(struct addrspace *as)
+{
+    spinlock_acquire(&asid_lock);
+    for (unsigned i = 0; i < MAXCPUS; i++) {
+        if (cpu_pagetable[i] == as->pagetable) {
+            cpu_pagetable[i] = NULL;
+        }
+    }
+    spinlock_release(&asid_lock);
 }
 
 /***************************************
  * Helper Functions
  ***************************************/
-/* Save an entry into TLB */
+/* Save an entry into TLB, tagged with this CPU's address space ID */
 void load_tlb(uint32_t entryhi, uint32_t entrylo)
 {
     int sql = splhigh();
+    entryhi |= cpu_asid[curcpu->c_number] << TLBHI_PIDSHIFT;
     tlb_random(entryhi, entrylo);
     splx(sql);
 }
 
+/* Like load_tlb, but replaces the entry for ENTRYHI if there is one */
+void update_tlb(uint32_t entryhi, uint32_t entrylo)
+{
+    int spl = splhigh();
+    entryhi |= cpu_asid[curcpu->c_number] << TLBHI_PIDSHIFT;
+    int index = tlb_probe(entryhi, 0);
+    if (index >= 0) {
+        tlb_write(entryhi, entrylo, index);
+    } else {
+        tlb_random(entryhi, entrylo);
+    }
+    splx(spl);
+}
+
+/* Drop AS's TLB entry for VADDR on this CPU, if there is one */
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    int spl = splhigh();
+    int index = tlb_probe((vaddr & PAGE_FRAME) | (as->as_asid << TLBHI_PIDSHIFT), 0);
+    if (index >= 0) {
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    }
+    /* the probe replaced the ASID user accesses are matched against */
+    tlb_setasid(cpu_asid[curcpu->c_number]);
+    splx(spl);
+}
+
+/* Invalidate every TLB entry on this CPU */
+void vm_tlbflush(void)
+{
+    int spl = splhigh();
+    for (int i = 0; i < NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setasid(cpu_asid[curcpu->c_number]);
+    splx(spl);
+}
+
+/***************************************
+ * TLB Shootdown
+ ***************************************/
 /*
- * Checks whether a region is valid
- * Iterate through all current process as's region and check whether its
- * within any of those regions.
+ * With ASIDs, entries for an address space stay in a CPU's TLB after
+ * it switches away, so a change to a mapping must reach every CPU in
+ * as_cpus, not just those running it now. The sender drops its own
+ * entries, interrupts the others with the whole range at once, and
+ * spins until they have all done theirs; only then may the old frame
+ * be reused. The caller must already have changed the page table
+ * entries (or cleared TLBLO_VALID in them) so that the UTLB refill
+ * cannot load the old mapping again.
  */
-int lookup_region(struct addrspace *as, vaddr_t vaddr, int faulttype)
+static struct spinlock shootdown_lock = SPINLOCK_INITIALIZER;
+
+/* Drop this CPU's entries for [start, end) of address space ASID */
+static void tlb_drop(uint32_t asid, vaddr_t start, vaddr_t end)
 {
-    struct region *curr = as->head;
-    while(curr != NULL) {
-        if (vaddr >= curr->base_addr &&
-            (vaddr < (curr->base_addr + curr->memsize))) {
-            break;
+    int spl = splhigh();
+    if ((end - start) / PAGE_SIZE <= TLBSHOOTDOWN_PAGES) {
+        for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+            int index = tlb_probe(va | (asid << TLBHI_PIDSHIFT), 0);
+            if (index >= 0) {
+                tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+            }
         }
-        curr = curr->next;
+    } else {
+        for (int i = 0; i < NUM_TLB; i++) {
+            uint32_t entryhi, entrylo;
+            tlb_read(&entryhi, &entrylo, i);
+            vaddr_t va = entryhi & TLBHI_VPAGE;
+            if ((entrylo & TLBLO_VALID) &&
+                (entryhi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid &&
+                va >= start && va < end) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    }
+    /* tlb_probe and tlb_read replaced the ASID in use */
+    tlb_setasid(cpu_asid[curcpu->c_number]);
+    splx(spl);
+}
+
+/* Drop AS's entries for [start, end) on every CPU */
+void vm_tlbshoot(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    volatile unsigned done = 0;
+    struct tlbshootdown ts;
+    uint32_t cpus;
+    unsigned n;
+
+    /* spinning with interrupts off would deadlock two senders */
+    KASSERT(curthread->t_iplhigh_count == 0);
+
+    spinlock_acquire(&asid_lock);
+    ts.ts_asid = as->as_asid;
+    cpus = as->as_cpus;
+    spinlock_release(&asid_lock);
+    ts.ts_start = start & PAGE_FRAME;
+    ts.ts_end = end;
+    ts.ts_done = &done;
+
+    /* stay on this CPU until it is both dropped here and sent */
+    int spl = splhigh();
+    tlb_drop(ts.ts_asid, ts.ts_start, ts.ts_end);
+    n = ipi_tlbshootdown_cpus(cpus, &ts);
+    vm_cpustats[curcpu->c_number].vs_shootdowns += n;
+    splx(spl);
+    while (done < n) {
+        /* wait; our own shootdown IPIs are still taken meanwhile */
     }
+    membar_load_load();
+}
+
+/* Called on the target CPU from interprocessor_interrupt */
+void vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+    tlb_drop(ts->ts_asid, ts->ts_start, ts->ts_end);
+    spinlock_acquire(&shootdown_lock);
+    (*ts->ts_done)++;
+    spinlock_release(&shootdown_lock);
+}
 
+/*
+ * Checks whether a region is valid
+ * Find the region containing vaddr and check its permissions against
+ * the fault.
+ */
+int lookup_region(struct addrspace *as, vaddr_t vaddr, int faulttype)
+{
+    struct region *curr = get_region(as, vaddr);
     if (curr == NULL)     return EFAULT; /* Cant find region thus return error */
 
     switch (faulttype)
@@ -290,16 +749,27 @@ int lookup_region(struct addrspace *as, vaddr_t vaddr, int faulttype)
     return 0;
 }
 
+/*
+ * Find the region containing vaddr. Faults tend to hit the same
+ * region over and over, so the last one found is tried first.
+ */
 struct region *get_region(struct addrspace *as, vaddr_t vaddr) {
-    struct region *curr = as->head;
-    while (curr != NULL) {
-        if (vaddr >= curr->base_addr &&
-            (vaddr < (curr->base_addr + curr->memsize))) {
-            return curr;
-        }
-        curr = curr->next;
+    struct region *curr = as->as_lastregion;
+    if (curr != NULL && vaddr >= curr->base_addr &&
+        vaddr < curr->base_addr + curr->memsize) {
+        return curr;
+    }
+
+    unsigned i = region_search(as, vaddr + 1);
+    if (i == 0) {
+        return NULL;
+    }
+    curr = regionarray_get(&as->as_regions, i - 1);
+    if (vaddr >= curr->base_addr + curr->memsize) {
+        return NULL;
     }
-    return NULL;
+    as->as_lastregion = curr;
+    return curr;
 }
 
 vaddr_t get_first_10_bits(vaddr_t addr) {
@@ -313,19 +783,90 @@ vaddr_t get_middle_10_bits(vaddr_t addr) {
 }
 
 
+/*
+ * Allocate a frame to back the user page at VADDR. The contents are
+ * left to the caller: region_fill for a fresh page, a copy of the old
+ * frame for copy-on-write, the swap slot for page-in.
+ * When physical memory runs out another user page is paged out to
+ * make room, so the caller must not hold any pt_lock.
+ */
 vaddr_t alloc_frame(struct addrspace *as, vaddr_t vaddr) {
-	/*  Allocate Frame for this region  */
-    (void)as;
-    vaddr = vaddr;
-	//struct region *region = get_region(as, vaddr);
-	//size_t regionSize = region->memsize;
-	/* calculate how many frame number we need */
-	//unsigned int frameNeeded = regionSize / PAGE_SIZE;
-	//vaddr_t newVaddr = alloc_kpages(frameNeeded);
+    (void)vaddr;
+    KASSERT(!lock_do_i_hold(as->pt_lock));
+
+    VMSTAT_INC(vs_frameallocs);
     vaddr_t newVaddr = alloc_kpages(1);
-	if (newVaddr == 0) return 0;
-	/* zero out the frame */
-	//bzero((void *) newVaddr, regionSize);
-    bzero((void *) newVaddr, PAGE_SIZE);
-	return newVaddr;
-}
\ No newline at end of file
+    while (newVaddr == 0) {
+        if (swap_evict() != 0) {
+            return 0;
+        }
+        newVaddr = alloc_kpages(1);
+    }
+    return newVaddr;
+}
+
+/*
+ * alloc_frame for a page that must start out zeroed. The idle loop
+ * keeps a pool of frames it has zeroed already (see frame_zero_get);
+ * only when that is empty do we clear one here.
+ */
+vaddr_t alloc_zeroed_frame(struct addrspace *as, vaddr_t vaddr) {
+    vaddr_t newVaddr = frame_zero_get();
+    if (newVaddr == 0) {
+        newVaddr = alloc_frame(as, vaddr);
+        if (newVaddr != 0) {
+            bzero((void *) newVaddr, PAGE_SIZE);
+        }
+    }
+    return newVaddr;
+}
+
+/***************************************
+ * VM Statistics
+ ***************************************/
+/* Sum the per-CPU counters; struct vmstat is nothing but __u32s */
+void vm_getstats(struct vmstat *vs)
+{
+    __u32 *sum = (__u32 *) vs;
+    unsigned nfields = sizeof(*vs) / sizeof(__u32);
+
+    bzero(vs, sizeof(*vs));
+    for (unsigned cpu = 0; cpu < MAXCPUS; cpu++) {
+        const __u32 *counts = (const __u32 *) &vm_cpustats[cpu];
+        for (unsigned i = 0; i < nfields; i++) {
+            sum[i] += counts[i];
+        }
+
+        unsigned hits, misses;
+        frame_cache_stats(cpu, &hits, &misses);
+        vs->vs_cachehits += hits;
+        vs->vs_cachemisses += misses;
+    }
+    vs->vs_framesfree = frame_free_count();
+    vs->vs_framestotal = frame_count();
+}
+
+void vm_printstats(void)
+{
+    struct vmstat vs;
+
+    vm_getstats(&vs);
+    kprintf("VM faults: %u (read %u, write %u, read-only %u)\n",
+            vs.vs_faults, vs.vs_faults_read, vs.vs_faults_write,
+            vs.vs_faults_readonly);
+    kprintf("  TLB reloads %u, zero-fills %u, zero page maps %u\n",
+            vs.vs_tlbreloads, vs.vs_zerofills, vs.vs_zeromaps);
+    kprintf("  file reads %u, shared text %u, fault-around %u\n",
+            vs.vs_filereads, vs.vs_textshares, vs.vs_faultaround);
+    kprintf("  COW copies %u, COW reuses %u\n",
+            vs.vs_cowcopies, vs.vs_cowreuses);
+    kprintf("Swap: %u in, %u out, %u text pages dropped\n",
+            vs.vs_swapins, vs.vs_swapouts, vs.vs_textdrops);
+    kprintf("Fork PTE copies %u, activations %u, shootdowns %u\n",
+            vs.vs_ptcopies, vs.vs_activates, vs.vs_shootdowns);
+    kprintf("Frames: %u free of %u; %u user allocs, %u pre-zeroed\n",
+            vs.vs_framesfree, vs.vs_framestotal, vs.vs_frameallocs,
+            vs.vs_zeropool);
+    kprintf("  frame cache hits %u, misses %u\n",
+            vs.vs_cachehits, vs.vs_cachemisses);
+}
@@ -148,6 +148,8 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+struct vmstat; /* see <kern/vmstat.h> */
+int __vmstat(struct vmstat *vs);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -164,8 +166,7 @@ time_t time(time_t *seconds);			/* calls __time */
  * You should implement this version as this is what we expect to test.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
+/* PROT_READ and PROT_WRITE come from <kern/unistd.h> */
 
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);